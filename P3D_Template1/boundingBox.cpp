@@ -49,7 +49,7 @@ Vector AABB::centroid(void) {
 }
 
 // --------------------------------------------------------------------- extend AABB
-void AABB::extend(AABB box) {
+void AABB::extend(const AABB& box) {
 	if (min.x > box.min.x) min.x = box.min.x;
 	if (min.y > box.min.y) min.y = box.min.y;
 	if (min.z > box.min.z) min.z = box.min.z;
@@ -8,7 +8,7 @@ public:
 	Vector min, max;
 
 	AABB(void);
-	virtual ~AABB();
+	~AABB();
 	AABB(const Vector& v0, const Vector& v1);
 	AABB(const AABB& bbox);
 	AABB operator= (const AABB& rhs);
@@ -16,7 +16,7 @@ public:
 	bool isInside(const Vector& p);
 	bool intercepts(const Ray& r, float& t);
 	Vector centroid(void);
-	void extend(AABB box);
+	void extend(const AABB& box);
 	float surface_area();
 
 };
\ No newline at end of file
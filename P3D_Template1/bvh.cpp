@@ -1,199 +1,761 @@
+#include <malloc.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
 #include "rayAccelerator.h"
+#include "threadPool.h"
 #include "macros.h"
 
 using namespace std;
 
-BVH::BVHNode::BVHNode(void) {}
+void BVH::BVHNode::setAABB(AABB& bbox_) {
+	this->bmin[0] = bbox_.min.x; this->bmin[1] = bbox_.min.y; this->bmin[2] = bbox_.min.z;
+	this->bmax[0] = bbox_.max.x; this->bmax[1] = bbox_.max.y; this->bmax[2] = bbox_.max.z;
+}
 
-void BVH::BVHNode::setAABB(AABB& bbox_) { this->bbox = bbox_; }
+AABB BVH::BVHNode::getAABB() const {
+	return AABB(Vector(bmin[0], bmin[1], bmin[2]), Vector(bmax[0], bmax[1], bmax[2]));
+}
 
 void BVH::BVHNode::makeLeaf(unsigned int index_, unsigned int n_objs_) {
-	this->leaf = true;
 	this->index = index_; 
 	this->n_objs = n_objs_; 
 }
 
-void BVH::BVHNode::makeNode(unsigned int left_index_) {
-	this->leaf = false;
-	this->index = left_index_; 
-			//this->n_objs = n_objs_; 
+void BVH::BVHNode::makeNode(unsigned int right_index_) {
+	this->index = right_index_; 
+	this->n_objs = 0;
+}
+
+// Slab test with the ray's reciprocal direction. t is the entry distance, clamped to 0 when the
+// ray starts inside the box, so that it never exceeds the distance of a hit inside the node.
+bool BVH::BVHNode::intercepts(const Vector& origin, const Vector& inv_dir, float& t) const {
+	float tx_min = (bmin[0] - origin.x) * inv_dir.x, tx_max = (bmax[0] - origin.x) * inv_dir.x;
+	float ty_min = (bmin[1] - origin.y) * inv_dir.y, ty_max = (bmax[1] - origin.y) * inv_dir.y;
+	float tz_min = (bmin[2] - origin.z) * inv_dir.z, tz_max = (bmax[2] - origin.z) * inv_dir.z;
+
+	if (inv_dir.x < 0) swap(tx_min, tx_max);
+	if (inv_dir.y < 0) swap(ty_min, ty_max);
+	if (inv_dir.z < 0) swap(tz_min, tz_max);
+
+	//largest entering t value
+	float t0 = MAX3(tx_min, ty_min, tz_min);
+
+	//smallest exiting t value
+	float t1 = MIN3(tx_max, ty_max, tz_max);
+
+	t = (t0 < 0) ? 0.0f : t0;
+
+	return (t0 < t1 && t1 > 0);
+}
+
+
+BVH::TriangleBlock::TriangleBlock(void) {
+	for (int d = 0; d < 3; d++) {
+		for (int i = 0; i < TRI_BLOCK_SIZE; i++) {
+			v0[d][i] = e1[d][i] = e2[d][i] = 0.0f;
+		}
+	}
+	for (int i = 0; i < TRI_BLOCK_SIZE; i++)
+		ref[i] = 0;
+}
+
+void BVH::TriangleBlock::setTriangle(int lane, const TrianglePrim& tri, unsigned int ref_) {
+	v0[0][lane] = tri.P0.x; v0[1][lane] = tri.P0.y; v0[2][lane] = tri.P0.z;
+	e1[0][lane] = tri.e1.x; e1[1][lane] = tri.e1.y; e1[2][lane] = tri.e1.z;
+	e2[0][lane] = tri.e2.x; e2[1][lane] = tri.e2.y; e2[2][lane] = tri.e2.z;
+	ref[lane] = ref_;
+}
+
+Vector BVH::TriangleBlock::getNormal(int lane) const {
+	Vector edge1 = Vector(e1[0][lane], e1[1][lane], e1[2][lane]), edge2 = Vector(e2[0][lane], e2[1][lane], e2[2][lane]);
+	Vector normal = edge1 % edge2;
+	normal.normalize();
+	return normal;
+}
+
+// Moller-Trumbore test of all the triangles of the block at once, with the same steps as TrianglePrim::intercepts.
+int BVH::TriangleBlock::intercepts(const Ray& ray, float tmin, float tmax, float& t, float& u, float& v) const {
+	vfloat dx(ray.direction.x), dy(ray.direction.y), dz(ray.direction.z);
+	vfloat e1x = vfloat::load(e1[0]), e1y = vfloat::load(e1[1]), e1z = vfloat::load(e1[2]);
+	vfloat e2x = vfloat::load(e2[0]), e2y = vfloat::load(e2[1]), e2z = vfloat::load(e2[2]);
+	vfloat zero(0.0f), one(1.0f);
+
+	//pvec = direction % e2
+	vfloat px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+	vfloat det = e1x * px + e1y * py + e1z * pz;
+	vfloat inv_det = one / det;
+
+	vfloat tx = vfloat(ray.origin.x) - vfloat::load(v0[0]);
+	vfloat ty = vfloat(ray.origin.y) - vfloat::load(v0[1]);
+	vfloat tz = vfloat(ray.origin.z) - vfloat::load(v0[2]);
+	vfloat bu = (tx * px + ty * py + tz * pz) * inv_det;
+
+	//qvec = tvec % e1
+	vfloat qx = ty * e1z - tz * e1y, qy = tz * e1x - tx * e1z, qz = tx * e1y - ty * e1x;
+	vfloat bv = (dx * qx + dy * qy + dz * qz) * inv_det;
+	vfloat dist = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+	//parallel rays and the null edges of unused lanes have det == 0
+	vfloat hit = ((det < zero) | (det > zero)) & (bu >= zero) & (bu <= one) & (bv >= zero) & (bu + bv <= one)
+		& (dist >= vfloat(tmin)) & (dist < vfloat(tmax));
+	int mask = movemask(hit);
+	if (mask == 0)
+		return -1;
+
+	float ts[TRI_BLOCK_SIZE], us[TRI_BLOCK_SIZE], vs[TRI_BLOCK_SIZE];
+	dist.store(ts);
+	bu.store(us);
+	bv.store(vs);
+
+	int lane = -1;
+	for (int i = 0; i < TRI_BLOCK_SIZE; i++) {
+		if ((mask & (1 << i)) && (lane < 0 || ts[i] < ts[lane]))
+			lane = i;
+	}
+	t = ts[lane];
+	u = us[lane];
+	v = vs[lane];
+	return lane;
+}
+
+
+BVH::SphereBlock::SphereBlock(void) {
+	for (int i = 0; i < SPHERE_BLOCK_SIZE; i++) {
+		center[0][i] = center[1][i] = center[2][i] = 0.0f;
+		SqRadius[i] = -FLT_MAX;
+		ref[i] = 0;
+	}
+}
+
+void BVH::SphereBlock::setSphere(int lane, const SpherePrim& sphere, unsigned int ref_) {
+	center[0][lane] = sphere.center.x; center[1][lane] = sphere.center.y; center[2][lane] = sphere.center.z;
+	SqRadius[lane] = sphere.SqRadius;
+	ref[lane] = ref_;
+}
+
+Vector BVH::SphereBlock::getNormal(int lane, const Ray& r, float t) const {
+	return (r.origin + r.direction * t - Vector(center[0][lane], center[1][lane], center[2][lane])).normalize();
+}
+
+// Test of all the spheres of the block at once, with the same steps as SpherePrim::intercepts
+int BVH::SphereBlock::intercepts(const Ray& ray, float tmin, float tmax, float& t) const {
+	vfloat ocx = vfloat::load(center[0]) - vfloat(ray.origin.x);
+	vfloat ocy = vfloat::load(center[1]) - vfloat(ray.origin.y);
+	vfloat ocz = vfloat::load(center[2]) - vfloat(ray.origin.z);
+	vfloat zero(0.0f);
+
+	vfloat b = vfloat(ray.direction.x) * ocx + vfloat(ray.direction.y) * ocy + vfloat(ray.direction.z) * ocz;
+	vfloat c = ocx * ocx + ocy * ocy + ocz * ocz - vfloat::load(SqRadius);
+	vfloat disc = b * b - c;
+
+	//the far hit when the origin is inside the sphere (c <= 0), else the near one, which must be in front of the origin
+	vfloat root = vsqrt(vmax(disc, zero));
+	vfloat outside = c > zero;
+	vfloat dist = select(outside, b - root, b + root);
+
+	//the negative squared radius of unused lanes makes their discriminant negative
+	vfloat hit = (disc > zero) & ((c <= zero) | (b > zero)) & (dist > vfloat(tmin)) & (dist < vfloat(tmax));
+	int mask = movemask(hit);
+	if (mask == 0)
+		return -1;
+
+	float ts[SPHERE_BLOCK_SIZE];
+	dist.store(ts);
+
+	int lane = -1;
+	for (int i = 0; i < SPHERE_BLOCK_SIZE; i++) {
+		if ((mask & (1 << i)) && (lane < 0 || ts[i] < ts[lane]))
+			lane = i;
+	}
+	t = ts[lane];
+	return lane;
 }
 
 
 BVH::BVH(void) {}
 
+BVH::~BVH(void) {
+	clear();
+}
+
+// Frees the tree and its blocks so that it can be built again
+void BVH::clear() {
+	if (nodes != NULL)
+		_aligned_free(nodes);
+	if (tri_blocks != NULL)
+		_aligned_free(tri_blocks);
+	if (sphere_blocks != NULL)
+		_aligned_free(sphere_blocks);
+	nodes = NULL; n_nodes = 0;
+	tri_blocks = NULL; n_tri_blocks = 0;
+	sphere_blocks = NULL; n_sphere_blocks = 0;
+	leaf_blocks.clear();
+	objects.clear();
+	prims.Clear();
+	max_depth = 0;
+}
+
 int BVH::getNumObjects() { return objects.size(); }
 
 
-void BVH::Build(vector<Object *> &objs) {
+void BVH::Build(vector<Object *> &objs, ThreadPool* pool) {
 
+			clear();
+			source_objs = objs;
 		
-			BVHNode *root = new BVHNode();
-
 			Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 			AABB world_bbox = AABB(min, max);
 
-			for (Object* obj : objs) {
-				AABB bbox = obj->GetBoundingBox();
+			prims.Compile(objs, mid_shutter_bounds);
+			prims.getRefs(objects);
+			for (const PrimRef& ref : objects) {
+				AABB bbox = prims.getBounds(ref);
 				world_bbox.extend(bbox);
-				objects.push_back(obj);
 			}
 			world_bbox.min.x -= EPSILON; world_bbox.min.y -= EPSILON; world_bbox.min.z -= EPSILON;
 			world_bbox.max.x += EPSILON; world_bbox.max.y += EPSILON; world_bbox.max.z += EPSILON;
-			root->setAABB(world_bbox);
-			nodes.push_back(root);
-			build_recursive(0, objects.size(), root); // -> root node takes all the 
+			if (objects.empty())
+				return;
+
+			vector<BVHNode> build_nodes;  //node list while the tree is being built
+			build_nodes.reserve(2 * objects.size());
+			max_depth = this->build_recursive(0, objects.size(), world_bbox, build_nodes, 0, pool); // -> root node takes all the 
+
+			//copy the depth-first node list to one cache-line aligned block
+			n_nodes = build_nodes.size();
+			nodes = (BVHNode*)_aligned_malloc(n_nodes * sizeof(BVHNode), 64);
+			memcpy(nodes, build_nodes.data(), n_nodes * sizeof(BVHNode));
+
+			this->pack_leaves();
+			build_cost = SAHCost();
+			if (!keep_bounds)
+				prims.releaseBounds();  //only the build and Refit() read it
+
+			printf("\nBVH: total nodes = %d, total objects = %d, depth = %d, SAH cost = %.2f\n", n_nodes, this->getNumObjects(), max_depth, build_cost);
+			if (n_tri_blocks > 0)
+				printf("BVH: %d triangle blocks of %d\n", n_tri_blocks, TRI_BLOCK_SIZE);
+			if (n_sphere_blocks > 0)
+				printf("BVH: %d sphere blocks of %d\n", n_sphere_blocks, SPHERE_BLOCK_SIZE);
+			printf("\n");
 		}
 
-void BVH::build_recursive(int left_index, int right_index, BVHNode *node) {
-	   //PUT YOUR CODE HERE
-	if ((right_index - left_index) <= 2) {
-		node->makeLeaf(left_index, right_index - left_index); // Check index
+/* Sorts the objects of every leaf by primitive type, so that they are tested in runs of one type, and repacks
+   the triangles, which come first, and the spheres, which follow them, in SoA blocks for the SIMD kernels. */
+void BVH::pack_leaves() {
+	//first pass: sort the leaves and count their blocks
+	for (unsigned int n = 0; n < n_nodes; n++) {
+		if (!nodes[n].isLeaf())
+			continue;
+		unsigned int first = nodes[n].getIndex(), last = first + nodes[n].getNObjs();
+
+		stable_sort(objects.begin() + first, objects.begin() + last);
+		unsigned int n_tris = 0, n_spheres = 0;
+		while (first + n_tris < last && objects[first + n_tris].type == PRIM_TRIANGLE)
+			n_tris++;
+		while (first + n_tris + n_spheres < last && objects[first + n_tris + n_spheres].type == PRIM_SPHERE)
+			n_spheres++;
+		if (n_tris == 0 && n_spheres == 0)
+			continue;
+
+		if (leaf_blocks.empty())
+			leaf_blocks.resize(objects.size(), LeafBlocks{ 0, 0, 0, 0 });
+		LeafBlocks& lb = leaf_blocks[first];
+		lb.first_tri_block = n_tri_blocks;
+		lb.n_tris = n_tris;
+		lb.first_sphere_block = n_sphere_blocks;
+		lb.n_spheres = n_spheres;
+		n_tri_blocks += (n_tris + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+		n_sphere_blocks += (n_spheres + SPHERE_BLOCK_SIZE - 1) / SPHERE_BLOCK_SIZE;
+	}
+
+	if (leaf_blocks.empty())
+		return;
+
+	//second pass: fill the blocks in place
+	if (n_tri_blocks > 0) {
+		tri_blocks = (TriangleBlock*)_aligned_malloc(n_tri_blocks * sizeof(TriangleBlock), 64);
+		for (unsigned int b = 0; b < n_tri_blocks; b++)
+			new (&tri_blocks[b]) TriangleBlock();
+	}
+	if (n_sphere_blocks > 0) {
+		sphere_blocks = (SphereBlock*)_aligned_malloc(n_sphere_blocks * sizeof(SphereBlock), 64);
+		for (unsigned int b = 0; b < n_sphere_blocks; b++)
+			new (&sphere_blocks[b]) SphereBlock();
 	}
-	else {
-		int split_index;
-		if (this->sah_splits < 3) {
-			split_index = this->SAH(left_index, right_index, node);
-			this->sah_splits++;
-		}
-		else {
-			split_index = this->find_split(left_index, right_index, node);
-		}
 
-		AABB left_bbox = this->build_bounding_box(left_index, split_index);
-		AABB right_bbox = this->build_bounding_box(split_index, right_index);
+	for (unsigned int n = 0; n < n_nodes; n++)
+		if (nodes[n].isLeaf())
+			fill_leaf_blocks(nodes[n].getIndex());
+	release_blocked_prims();
+}
+
+/* Every triangle and sphere is in a leaf block once they are filled, so their TrianglePrim and SpherePrim copies
+   are freed, and the blocks are the one copy that is traced. Refit() compiles them again to refill the blocks. */
+void BVH::release_blocked_prims() {
+	vector<TrianglePrim>().swap(prims.triangles);
+	vector<SpherePrim>().swap(prims.spheres);
+}
 
-		BVHNode* left_node = new BVHNode();
-		BVHNode* right_node = new BVHNode();
+// Copies the triangles and spheres of the leaf starting at objects[first] to its blocks
+void BVH::fill_leaf_blocks(unsigned int first) {
+	const LeafBlocks& lb = leaf_blocks[first];
+	for (unsigned int i = 0; i < lb.n_tris; i++)
+		tri_blocks[lb.first_tri_block + i / TRI_BLOCK_SIZE].setTriangle(i % TRI_BLOCK_SIZE, prims.triangles[objects[first + i].index], first + i);
+	unsigned int first_sphere = first + lb.n_tris;
+	for (unsigned int i = 0; i < lb.n_spheres; i++)
+		sphere_blocks[lb.first_sphere_block + i / SPHERE_BLOCK_SIZE].setSphere(i % SPHERE_BLOCK_SIZE, prims.spheres[objects[first_sphere + i].index], first_sphere + i);
+}
+
+/* The objects compile to the same primitives in the same order as in the last build, so the references in the
+   leaves stay valid and only the primitive data, the leaf blocks and the node bounds need updating. The leaves
+   are independent; the interior nodes are then visited backwards, since children follow their parent in
+   depth-first order. */
+void BVH::Refit(ThreadPool* pool) {
+	if (nodes == NULL)
+		return;
+
+	unsigned int n_prims = prims.size();
+	prims.Clear();
+	prims.Compile(source_objs, mid_shutter_bounds);
+	if (prims.size() != n_prims) {
+		printf("BVH: the objects changed their number of primitives, rebuilding\n");
+		vector<Object*> objs = source_objs;
+		Build(objs, pool);
+		return;
+	}
 
-		node->makeNode(this->nodes.size());
+	auto refit_leaves = [this](int begin, int end) {
+		for (int n = begin; n < end; n++) {
+			if (!nodes[n].isLeaf())
+				continue;
+			unsigned int first = nodes[n].getIndex();
+			if (!leaf_blocks.empty())
+				fill_leaf_blocks(first);
+			AABB bbox = build_bounding_box(first, first + nodes[n].getNObjs());
+			nodes[n].setAABB(bbox);
+		}
+	};
+	if (pool != NULL)
+		pool->ParallelFor(0, n_nodes, 1024, refit_leaves);
+	else
+		refit_leaves(0, n_nodes);
+	release_blocked_prims();
+
+	for (int n = (int)n_nodes - 1; n >= 0; n--) {
+		if (nodes[n].isLeaf())
+			continue;
+		AABB bbox = nodes[n + 1].getAABB();
+		bbox.extend(nodes[nodes[n].getIndex()].getAABB());
+		nodes[n].setAABB(bbox);
+	}
+	if (!keep_bounds)
+		prims.releaseBounds();
+}
 
-		left_node->setAABB(left_bbox);
-		right_node->setAABB(right_bbox);
+// Refitting keeps the topology of the tree, which degrades as the objects move away from where it was built
+bool BVH::Update(ThreadPool* pool) {
+	Refit(pool);
 
+	float cost = SAHCost();
+	if (cost <= build_cost * (1.0f + BVH_REBUILD_THRESHOLD))
+		return false;
 
-		nodes.push_back(left_node);
-		nodes.push_back(right_node);
+	printf("BVH: SAH cost went from %.2f to %.2f after refitting, rebuilding\n", build_cost, cost);
+	vector<Object*> objs = source_objs;
+	Build(objs, pool);
+	return true;
+}
 
-		this->build_recursive(left_index, split_index, left_node);
-		this->build_recursive(split_index, right_index, right_node);
-		//right_index, left_index and split_index refer to the indices in the objects vector
-	   // do not confuse with left_nodde_index and right_nodex which refer to indices in the nodes vector. 
-		// node.index can have a index of objects vector or a index of nodes vector
+// Expected cost of a random ray according to the SAH: every node costs its traversal step and every leaf
+// its object tests, weighted by the probability of hitting the node relative to the root
+float BVH::SAHCost() const {
+	if (nodes == NULL)
+		return 0.0f;
+
+	float sa_root = nodes[0].getAABB().surface_area();
+	float cost = 0.0f;
+
+	for (unsigned int i = 0; i < n_nodes; i++) {
+		float p = nodes[i].getAABB().surface_area() / sa_root;
+		if (nodes[i].isLeaf())
+			cost += p * nodes[i].getNObjs() * cost_intersection;
+		else
+			cost += p * cost_traversal;
 	}
+	return cost;
 }
 
-int BVH::find_split(int left_index, int right_index, BVHNode *node) {
-	AABB bbox = node->getAABB();
-	int largest_dim = (bbox.max - bbox.min).max_dimension();
-	float largest_dist = (bbox.max - bbox.min).getAxisValue(largest_dim);
+// Appends the subtree over objects [left_index, right_index) to node_list in depth-first order and returns
+// its deepest level. Interior node indices are relative to the start of node_list.
+// With a pool, both children of a large node are built at the same time into separate lists that are then
+// appended in the same order as the serial build, so the tree does not depend on the number of threads.
+int BVH::build_recursive(int left_index, int right_index, AABB& bbox, vector<BVHNode>& node_list, int depth, ThreadPool* pool) {
+	   //PUT YOUR CODE HERE
+	unsigned int node_index = node_list.size();
+	AABB left_bbox, right_bbox;
+	int split_index = -1;
+
+	BVHNode node;
+	node.setAABB(bbox);
+	node_list.push_back(node);
 
-	BVH::Comparator comparator;
-	comparator.dimension = largest_dim;
-	std::sort(this->objects.begin() + left_index, this->objects.begin() + right_index, comparator);
+	if ((right_index - left_index) > Threshold)
+		split_index = this->SAH(left_index, right_index, bbox, left_bbox, right_bbox, pool);
 
-	int split_index = left_index;
-	if (this->objects[left_index]->getCentroid().getAxisValue(largest_dim) > largest_dist / 2 || this->objects[right_index - 1]->getCentroid().getAxisValue(largest_dim) < largest_dist / 2) {
-		return (right_index + left_index) / 2;
+	if (split_index < 0) {
+		node_list[node_index].makeLeaf(left_index, right_index - left_index); // Check index
+		return depth;
 	}
-	while (split_index < right_index && this->objects[split_index]->getCentroid().getAxisValue(largest_dim) < largest_dist/2) {
-		split_index++;	
+
+	int left_depth, right_depth;
+
+	if (pool != NULL && (right_index - left_index) > BVH_TASK_SIZE) {
+		vector<BVHNode> left_list, right_list;
+		TaskGroup group;
+
+		pool->Spawn(group, [&]() {
+			left_depth = this->build_recursive(left_index, split_index, left_bbox, left_list, depth + 1, pool);
+		});
+		right_depth = this->build_recursive(split_index, right_index, right_bbox, right_list, depth + 1, pool);
+		pool->Wait(group);
+
+		//depth-first layout: the left subtree is stored right after its parent, then the right subtree
+		unsigned int left_node_index = node_list.size();
+		unsigned int right_node_index = left_node_index + left_list.size();
+		node_list.reserve(right_node_index + right_list.size());
+		for (BVHNode& n : left_list) {
+			if (!n.isLeaf()) n.makeNode(n.getIndex() + left_node_index);
+			node_list.push_back(n);
+		}
+		for (BVHNode& n : right_list) {
+			if (!n.isLeaf()) n.makeNode(n.getIndex() + right_node_index);
+			node_list.push_back(n);
+		}
+		node_list[node_index].makeNode(right_node_index);
 	}
-	if(split_index < right_index && split_index > left_index) {
-		return split_index;
+	else {
+		//depth-first layout: the left child is stored right after its parent
+		left_depth = this->build_recursive(left_index, split_index, left_bbox, node_list, depth + 1, pool);
+
+		unsigned int right_node_index = node_list.size();
+		node_list[node_index].makeNode(right_node_index);
+		right_depth = this->build_recursive(split_index, right_index, right_bbox, node_list, depth + 1, pool);
 	}
-	
+	//right_index, left_index and split_index refer to the indices in the objects vector
+	// do not confuse with left_nodde_index and right_nodex which refer to indices in the nodes vector. 
+	// node.index can have a index of objects vector or a index of nodes vector
+	return MAX(left_depth, right_depth);
 }
 
-int BVH::SAH(int left_index, int right_index, BVHNode* node) {
-	float cost_traversal = 1.0f;
-	float cost_intersection = 10.0f;
-
-	float min_c = FLT_MAX;
-	float split_index;
-	float cp = (right_index - left_index) * cost_intersection;
-	
-	BVH::Comparator comparator;
+/* Binned SAH: the centroids of the node's objects are distributed over SAH_BINS bins along each axis and
+   the plane between two bins with the lowest cost is chosen. Returns the split index in the objects vector,
+   with the objects partitioned around it and the bounding boxes of both sides, or -1 when a leaf is cheaper.
+   Large nodes are binned in fixed-size chunks on the pool and the chunk bins are merged afterwards. */
+int BVH::SAH(int left_index, int right_index, AABB& bbox, AABB& left_bbox, AABB& right_bbox, ThreadPool* pool) {
+	int n_objs = right_index - left_index;
+	Vector empty_min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), empty_max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	bool parallel = (pool != NULL && n_objs > BVH_BIN_CHUNK);
+	int n_chunks = parallel ? (n_objs + BVH_BIN_CHUNK - 1) / BVH_BIN_CHUNK : 1;
+
+	//bounds of the centroids
+	AABB centroid_bbox = AABB(empty_min, empty_max);
+	if (parallel) {
+		vector<AABB> chunk_bbox(n_chunks);
+		pool->ParallelFor(0, n_chunks, 1, [&](int first, int last) {
+			for (int c = first; c < last; c++)
+				chunk_bbox[c] = this->centroid_bounds(left_index + c * BVH_BIN_CHUNK, MIN(left_index + (c + 1) * BVH_BIN_CHUNK, right_index));
+		});
+		for (AABB& b : chunk_bbox)
+			centroid_bbox.extend(b);
+	}
+	else
+		centroid_bbox = this->centroid_bounds(left_index, right_index);
+
+	SAHBin bins[3][SAH_BINS];
+	if (parallel) {
+		vector<SAHBin> chunk_bins(n_chunks * 3 * SAH_BINS);
+		pool->ParallelFor(0, n_chunks, 1, [&](int first, int last) {
+			for (int c = first; c < last; c++)
+				this->bin_objects(left_index + c * BVH_BIN_CHUNK, MIN(left_index + (c + 1) * BVH_BIN_CHUNK, right_index), centroid_bbox,
+					(SAHBin(*)[SAH_BINS])&chunk_bins[c * 3 * SAH_BINS]);
+		});
+		for (int d = 0; d < 3; d++) {
+			for (int b = 0; b < SAH_BINS; b++) {
+				bins[d][b].bbox = AABB(empty_min, empty_max);
+				bins[d][b].count = 0;
+				for (int c = 0; c < n_chunks; c++) {
+					SAHBin& cb = chunk_bins[(c * 3 + d) * SAH_BINS + b];
+					bins[d][b].bbox.extend(cb.bbox);
+					bins[d][b].count += cb.count;
+				}
+			}
+		}
+	}
+	else
+		this->bin_objects(left_index, right_index, centroid_bbox, bins);
 
-	float sa_p = node->getAABB().surface_area(), sa_l, sa_r;
+	float sa_p = bbox.surface_area();
+	float best_cost = FLT_MAX;
+	int best_axis = -1, best_bin = 0;
+	AABB best_left = AABB(empty_min, empty_max), best_right = AABB(empty_min, empty_max);
 
 	for (int d = 0; d < 3; d++) {
-		int k = 1;
-		comparator.dimension = 0;
-		std::sort(this->objects.begin() + left_index, this->objects.begin() + right_index, comparator);
+		if (centroid_bbox.max.getAxisValue(d) - centroid_bbox.min.getAxisValue(d) <= 0.0f)
+			continue;  //all the centroids lie on the same plane
+
+		//sweep from the right to get the area and count on the right side of each plane
+		float right_area[SAH_BINS];
+		int right_count[SAH_BINS];
+		AABB acc = AABB(empty_min, empty_max);
+		int count = 0;
+		for (int b = SAH_BINS - 1; b > 0; b--) {
+			acc.extend(bins[d][b].bbox);
+			count += bins[d][b].count;
+			right_area[b] = count ? acc.surface_area() : 0.0f;
+			right_count[b] = count;
+		}
 
-		vector<float> r_surface_areas;
-		Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
-		AABB right_bbox = AABB(min, max);
+		//sweep from the left and evaluate the plane between bin b - 1 and bin b
+		acc = AABB(empty_min, empty_max);
+		count = 0;
+		for (int b = 1; b < SAH_BINS; b++) {
+			acc.extend(bins[d][b - 1].bbox);
+			count += bins[d][b - 1].count;
+			if (count == 0 || right_count[b] == 0)
+				continue;
 
-		AABB left_bbox = AABB(min, max);
+			float cost = cost_traversal + (acc.surface_area() * count + right_area[b] * right_count[b]) / sa_p * cost_intersection;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = d;
+				best_bin = b;
+				best_left = acc;
+			}
+		}
 
-		for (int i = right_index - 1; i >= left_index + 1; i--) {
-			Object* o = this->objects[i];
-			right_bbox.extend(o->GetBoundingBox());
-			r_surface_areas.push_back(right_bbox.surface_area());
+		if (best_axis == d) {
+			best_right = AABB(empty_min, empty_max);
+			for (int b = best_bin; b < SAH_BINS; b++)
+				best_right.extend(bins[d][b].bbox);
 		}
+	}
 
+	//termination: keep a leaf when splitting does not pay off and the leaf is small enough
+	float leaf_cost = n_objs * cost_intersection;
+	if (best_axis < 0 || best_cost >= leaf_cost) {
+		if (n_objs <= MaxLeafSize)
+			return -1;
+		if (best_axis < 0) {  //no plane separates the centroids: split the list in half
+			int split_index = (left_index + right_index) / 2;
+			left_bbox = this->build_bounding_box(left_index, split_index);
+			right_bbox = this->build_bounding_box(split_index, right_index);
+			return split_index;
+		}
+	}
 
-		for (int i = left_index; i < right_index; i++, k++) {
-			Object* o = this->objects[i];
-			left_bbox.extend(o->GetBoundingBox());
+	float c_min = centroid_bbox.min.getAxisValue(best_axis);
+	float scale = SAH_BINS / (centroid_bbox.max.getAxisValue(best_axis) - c_min);
+	auto middle = std::partition(this->objects.begin() + left_index, this->objects.begin() + right_index, [&](const PrimRef& o) {
+		int b = min(SAH_BINS - 1, (int)((prims.getCentroid(o).getAxisValue(best_axis) - c_min) * scale));
+		return b < best_bin;
+	});
 
-			sa_l = left_bbox.surface_area();
-			sa_r = r_surface_areas[right_index - 2 -  i];
+	left_bbox = best_left;
+	right_bbox = best_right;
+	return (int)(middle - this->objects.begin());
+}
 
-			float c = cost_traversal + (sa_l / sa_p) * k * cost_intersection + (sa_r / sa_p) * (right_index - (left_index + k)) * cost_intersection;
+// Distributes the objects [left_index, right_index) over the bins of the three axes
+void BVH::bin_objects(int left_index, int right_index, AABB& centroid_bbox, SAHBin bins[3][SAH_BINS]) {
+	Vector empty_min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), empty_max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	float c_min[3], scale[3];
 
-			if (c < cp) {
-				if (c < min_c) {
-					min_c = c;
-					split_index = left_index + k;
-				}
-				break;
+	for (int d = 0; d < 3; d++) {
+		float extent = centroid_bbox.max.getAxisValue(d) - centroid_bbox.min.getAxisValue(d);
+		c_min[d] = centroid_bbox.min.getAxisValue(d);
+		scale[d] = (extent > 0.0f) ? SAH_BINS / extent : 0.0f;
+		for (int b = 0; b < SAH_BINS; b++) {
+			bins[d][b].bbox = AABB(empty_min, empty_max);
+			bins[d][b].count = 0;
+		}
+	}
+
+	//the cached bounds are accumulated in plain floats and copied to the bins at the end
+	float bin_min[3][SAH_BINS][3], bin_max[3][SAH_BINS][3];
+	for (int d = 0; d < 3; d++) {
+		for (int b = 0; b < SAH_BINS; b++) {
+			for (int k = 0; k < 3; k++) {
+				bin_min[d][b][k] = FLT_MAX;
+				bin_max[d][b][k] = -FLT_MAX;
 			}
 		}
 	}
-	if (split_index >= right_index) {
-		return (right_index + left_index) / 2;
+
+	for (int i = left_index; i < right_index; i++) {
+		const AABB& obj_bbox = prims.getBounds(this->objects[i]);
+		const Vector& c = prims.getCentroid(this->objects[i]);
+		float o_min[3] = { obj_bbox.min.x, obj_bbox.min.y, obj_bbox.min.z };
+		float o_max[3] = { obj_bbox.max.x, obj_bbox.max.y, obj_bbox.max.z };
+		float o_c[3] = { c.x, c.y, c.z };
+		for (int d = 0; d < 3; d++) {
+			int b = min(SAH_BINS - 1, (int)((o_c[d] - c_min[d]) * scale[d]));
+			for (int k = 0; k < 3; k++) {
+				bin_min[d][b][k] = MIN(bin_min[d][b][k], o_min[k]);
+				bin_max[d][b][k] = MAX(bin_max[d][b][k], o_max[k]);
+			}
+			bins[d][b].count++;
+		}
+	}
+
+	for (int d = 0; d < 3; d++) {
+		for (int b = 0; b < SAH_BINS; b++) {
+			if (bins[d][b].count > 0)
+				bins[d][b].bbox = AABB(Vector(bin_min[d][b][0], bin_min[d][b][1], bin_min[d][b][2]), Vector(bin_max[d][b][0], bin_max[d][b][1], bin_max[d][b][2]));
+		}
 	}
-	return split_index;
 }
 
+AABB BVH::centroid_bounds(int left_index, int right_index) {
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	AABB bbox = AABB(min, max);
 
+	for (int i = left_index; i < right_index; i++) {
+		const Vector& c = prims.getCentroid(this->objects[i]);
+		bbox.min.x = MIN(bbox.min.x, c.x); bbox.min.y = MIN(bbox.min.y, c.y); bbox.min.z = MIN(bbox.min.z, c.z);
+		bbox.max.x = MAX(bbox.max.x, c.x); bbox.max.y = MAX(bbox.max.y, c.y); bbox.max.z = MAX(bbox.max.z, c.z);
+	}
 
+	return bbox;
+}
 
 AABB BVH::build_bounding_box(int left_index, int right_index) {
 	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 	AABB bbox = AABB(min, max);
 
-	for (int i = left_index; i < right_index; i++) {
-		AABB obj_bbox = this->objects[i]->GetBoundingBox();
-		bbox.extend(obj_bbox);
-	}
+	for (int i = left_index; i < right_index; i++)
+		bbox.extend(prims.getBounds(this->objects[i]));
 
 	return bbox;
 }
 
-bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
-	float tmp;
-	float tmin = FLT_MAX, t;  //contains the closest primitive intersection
+// Closest hit among the objects [first, first + n_objs) of a leaf: its triangle and sphere blocks, then the other objects.
+// Same contract as traverse_subtree: returns true when a hit closer than tmin is found.
+bool BVH::intersect_leaf(unsigned int first, unsigned int n_objs, Ray& ray, float& tmin, Object** hit_obj, HitRecord& hit_rec) const {
 	bool hit = false;
+	if (leaf_blocks.empty())
+		return prims.intersect(&objects[first], n_objs, ray, tmin, hit_obj, hit_rec);
+
+	const LeafBlocks& lb = leaf_blocks[first];
+
+	if (lb.n_tris > 0) {
+		const TriangleBlock* block = &tri_blocks[lb.first_tri_block];
+		const TriangleBlock* last = block + (lb.n_tris + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+		for (; block < last; block++) {
+			float t, u, v;
+			int lane = block->intercepts(ray, 0.0f, tmin, t, u, v);
+			if (lane < 0)
+				continue;
+			const PrimRef& ref = this->objects[block->ref[lane]];
+			const PrimOwner& owner = prims.getOwner(ref);
+			tmin = t;
+			hit_rec.t = t;
+			hit_rec.u = u;
+			hit_rec.v = v;
+			hit_rec.prim_id = owner.prim;
+			hit_rec.normal = block->getNormal(lane);
+			*hit_obj = owner.obj;
+			hit = true;
+		}
+	}
+
+	if (lb.n_spheres > 0) {
+		const SphereBlock* block = &sphere_blocks[lb.first_sphere_block];
+		const SphereBlock* last = block + (lb.n_spheres + SPHERE_BLOCK_SIZE - 1) / SPHERE_BLOCK_SIZE;
+		for (; block < last; block++) {
+			float t;
+			int lane = block->intercepts(ray, 0.0f, tmin, t);
+			if (lane < 0)
+				continue;
+			const PrimRef& ref = this->objects[block->ref[lane]];
+			const PrimOwner& owner = prims.getOwner(ref);
+			tmin = t;
+			hit_rec.t = t;
+			hit_rec.u = hit_rec.v = 0.0f;
+			hit_rec.prim_id = owner.prim;
+			hit_rec.normal = block->getNormal(lane, ray, t);
+			*hit_obj = owner.obj;
+			hit = true;
+		}
+	}
+
+	//the other primitives of the leaf, in runs of one type
+	unsigned int n_blocked = lb.n_tris + lb.n_spheres;
+	if (n_blocked < n_objs && prims.intersect(&objects[first + n_blocked], n_objs - n_blocked, ray, tmin, hit_obj, hit_rec))
+		hit = true;
+	return hit;
+}
+
+bool BVH::occluded_leaf(unsigned int first, unsigned int n_objs, Ray& ray) const {
+	if (leaf_blocks.empty())
+		return prims.occluded(&objects[first], n_objs, ray);
+
+	const LeafBlocks& lb = leaf_blocks[first];
+
+	if (lb.n_tris > 0) {
+		float t, u, v;
+		const TriangleBlock* block = &tri_blocks[lb.first_tri_block];
+		const TriangleBlock* last = block + (lb.n_tris + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+		for (; block < last; block++)
+			if (block->intercepts(ray, ray.tmin, ray.tmax, t, u, v) >= 0)
+				return true;
+	}
 
-	BVHNode* currentNode = nodes[0];
-	AABB current_bbox = currentNode->getAABB(); 
-	if (!current_bbox.intercepts(ray, t)) {
+	if (lb.n_spheres > 0) {
+		float t;
+		const SphereBlock* block = &sphere_blocks[lb.first_sphere_block];
+		const SphereBlock* last = block + (lb.n_spheres + SPHERE_BLOCK_SIZE - 1) / SPHERE_BLOCK_SIZE;
+		for (; block < last; block++)
+			if (block->intercepts(ray, ray.tmin, ray.tmax, t) >= 0)
+				return true;
+	}
+
+	unsigned int n_blocked = lb.n_tris + lb.n_spheres;
+	return n_blocked < n_objs && prims.occluded(&objects[first + n_blocked], n_objs - n_blocked, ray);
+}
+
+bool BVH::Traverse(Ray& ray, Object** hit_obj, HitRecord& hit_rec, StackItem* stack) const {
+	float tmin = ray.tmax;  //contains the closest primitive intersection
+
+	if (nodes == NULL)
+		return false;
+
+	Vector inv_dir = Vector(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	return this->traverse_subtree(&nodes[0], ray, inv_dir, tmin, hit_obj, hit_rec, stack);
+}
+
+// Closest-hit traversal of the subtree below start_node. tmin is the closest hit found so far; it is updated
+// together with hit_obj and hit_rec, and the function returns true, when a closer hit is found in the subtree.
+bool BVH::traverse_subtree(const BVHNode* start_node, Ray& ray, const Vector& inv_dir, float& tmin, Object** hit_obj, HitRecord& hit_rec, StackItem* stack) const {
+	float t;
+	bool hit = false;
+	int stack_ptr = 0;  //number of items in the caller's stack
+
+	const BVHNode* currentNode = start_node;
+	if (!currentNode->intercepts(ray.origin, inv_dir, t)) {
 		return false;
 	}
 
 	while (true) {
 		if (!currentNode->isLeaf()) {
-			BVHNode* left_child = this->nodes[currentNode->getIndex()];
-			BVHNode* right_child = this->nodes[currentNode->getIndex() + 1];
+			const BVHNode* left_child = currentNode + 1;
+			const BVHNode* right_child = &this->nodes[currentNode->getIndex()];
 
 			float temp1 = 0, temp2 = 0;
 
-			bool left_hit = left_child->getAABB().intercepts(ray, temp1);
-			bool right_hit = right_child->getAABB().intercepts(ray, temp2);
+			bool left_hit = left_child->intercepts(ray.origin, inv_dir, temp1);
+			bool right_hit = right_child->intercepts(ray.origin, inv_dir, temp2);
 			if (left_hit && right_hit) {
 				StackItem si(left_child, temp1);
 				currentNode = right_child;
@@ -202,7 +764,7 @@ bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
 					si.t = temp2;
 					currentNode = left_child;
 				}
-				this->hit_stack.push(si);
+				stack[stack_ptr++] = si;
 				continue;
 			}
 
@@ -213,64 +775,53 @@ bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
 		}
 
 		else {
-			for (int i = currentNode->getIndex(); i < currentNode->getIndex() + currentNode->getNObjs(); i++) {
-				Object* o = this->objects[i];
-				float temp;
-				if (o->GetBoundingBox().intercepts(ray, temp)) {
-					if (o->intercepts(ray, temp) && temp < tmin) {
-						tmin = temp;
-						*hit_obj = o;
-					}
-				}
-			}
+			if (this->intersect_leaf(currentNode->getIndex(), currentNode->getNObjs(), ray, tmin, hit_obj, hit_rec))
+				hit = true;
 		}
 
 
 		while (true) {
-			if (this->hit_stack.empty()) {
-				if (tmin == FLT_MAX) {
-					return false;
-				}
-				hit_point = ray.origin + ray.direction * tmin;
-				return true;
+			if (stack_ptr == 0) {
+				return hit;
 			}
 
-			StackItem si = this->hit_stack.top();
+			StackItem si = stack[--stack_ptr];
 			if (si.t < tmin) {
 				currentNode = si.ptr;
-				this->hit_stack.pop();
 				break;
 			}
-			this->hit_stack.pop();
 		}
 	}
 
-	hit_point = ray.origin + ray.direction * tmin;
-	return true;
+	return hit;
 }
 
-bool BVH::Traverse(Ray& ray) {  //shadow ray with length
-	float tmp;
+// Nodes entered beyond ray.tmax are never visited.
+bool BVH::Occluded(Ray& ray, StackItem* stack) const {
+	float t;
+	int stack_ptr = 0;
 
-	double length = ray.direction.length(); //distance between light and intersection point
-	ray.direction.normalize();
+	if (nodes == NULL)
+		return false;
+
+	Vector inv_dir = Vector(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
 
-	BVHNode* currentNode = nodes[0];
-	AABB current_bbox = currentNode->getAABB();
-	if (!current_bbox.intercepts(ray, tmp)) {
+	const BVHNode* currentNode = &nodes[0];
+	if (!currentNode->intercepts(ray.origin, inv_dir, t) || t > ray.tmax) {
 		return false;
 	}
 
 	while (true) {
 		if (!currentNode->isLeaf()) {
-			BVHNode* left_child = this->nodes[currentNode->getIndex()];
-			BVHNode* right_child = this->nodes[currentNode->getIndex() + 1];
+			const BVHNode* left_child = currentNode + 1;
+			const BVHNode* right_child = &this->nodes[currentNode->getIndex()];
 
 			float temp1 = 0, temp2 = 0;
 
-			bool left_hit = left_child->getAABB().intercepts(ray, temp1);
-			bool right_hit = right_child->getAABB().intercepts(ray, temp2);
+			bool left_hit = left_child->intercepts(ray.origin, inv_dir, temp1) && temp1 <= ray.tmax;
+			bool right_hit = right_child->intercepts(ray.origin, inv_dir, temp2) && temp2 <= ray.tmax;
 			if (left_hit && right_hit) {
+				//any hit ends the query, but the nearer child is more likely to hold an occluder
 				StackItem si(left_child, temp1);
 				currentNode = right_child;
 				if (temp2 > temp1) {
@@ -278,7 +829,7 @@ bool BVH::Traverse(Ray& ray) {  //shadow ray with length
 					si.t = temp2;
 					currentNode = left_child;
 				}
-				this->hit_stack.push(si);
+				stack[stack_ptr++] = si;
 				continue;
 			}
 
@@ -289,29 +840,206 @@ bool BVH::Traverse(Ray& ray) {  //shadow ray with length
 		}
 
 		else {
-			for (int i = currentNode->getIndex(); i < currentNode->getIndex() + currentNode->getNObjs(); i++) {
-				Object* o = this->objects[i];
-				float temp;
-				if (o->GetBoundingBox().intercepts(ray, temp)) {
-					if (o->intercepts(ray, temp)) {
-						return true;
-					}
-				}
+			if (this->occluded_leaf(currentNode->getIndex(), currentNode->getNObjs(), ray))
+				return true;
+		}
+
+		if (stack_ptr == 0)
+			return false;
+		currentNode = stack[--stack_ptr].ptr;
+	}
+}
+
+// Slab test of all the rays of a packet; returns the mask of rays that enter the node before their closest hit,
+// and in t_entry the nearest distance at which one of them enters it
+int BVH::BVHNode::interceptsPacket(const RayPacket& packet, const int* sign, float& t_entry) const {
+	vfloat near_x(sign[0] ? bmax[0] : bmin[0]), far_x(sign[0] ? bmin[0] : bmax[0]);
+	vfloat near_y(sign[1] ? bmax[1] : bmin[1]), far_y(sign[1] ? bmin[1] : bmax[1]);
+	vfloat near_z(sign[2] ? bmax[2] : bmin[2]), far_z(sign[2] ? bmin[2] : bmax[2]);
+	vfloat entry(FLT_MAX);
+	int mask = 0;
+
+	for (int i = 0; i < RAY_PACKET_SIZE; i += SIMD_WIDTH) {
+		vfloat ox = vfloat::load(packet.ox + i), oy = vfloat::load(packet.oy + i), oz = vfloat::load(packet.oz + i);
+		vfloat ix = vfloat::load(packet.ix + i), iy = vfloat::load(packet.iy + i), iz = vfloat::load(packet.iz + i);
+
+		vfloat t0 = vmax(vmax((near_x - ox) * ix, (near_y - oy) * iy), vmax((near_z - oz) * iz, vfloat(0.0f)));
+		vfloat t1 = vmin(vmin((far_x - ox) * ix, (far_y - oy) * iy), vmin((far_z - oz) * iz, vfloat::load(packet.tmax + i)));
+
+		vfloat hit = t0 < t1;
+		entry = vmin(entry, select(hit, t0, vfloat(FLT_MAX)));
+		mask |= movemask(hit) << i;
+	}
+
+	float entries[SIMD_WIDTH];
+	entry.store(entries);
+	t_entry = entries[0];
+	for (int i = 1; i < SIMD_WIDTH; i++)
+		t_entry = MIN(t_entry, entries[i]);
+	return mask;
+}
+
+/* Conservative test of a packet of rays, using the intervals of their origins and of their reciprocal directions:
+   the earliest entry and the latest exit of any ray on each axis. Returns false only when no ray of the packet
+   can enter the node. With a common origin, o_min and o_max are the same point. */
+bool BVH::BVHNode::interceptsFrustum(const float* o_min, const float* o_max, const float* inv_min, const float* inv_max, const int* sign) const {
+	float t0 = 0.0f, t1 = FLT_MAX;
+
+	for (int d = 0; d < 3; d++) {
+		float near_plane = sign[d] ? bmax[d] : bmin[d];
+		float far_plane = sign[d] ? bmin[d] : bmax[d];
+		float near_t[4] = { (near_plane - o_min[d]) * inv_min[d], (near_plane - o_min[d]) * inv_max[d],
+			(near_plane - o_max[d]) * inv_min[d], (near_plane - o_max[d]) * inv_max[d] };
+		float far_t[4] = { (far_plane - o_min[d]) * inv_min[d], (far_plane - o_min[d]) * inv_max[d],
+			(far_plane - o_max[d]) * inv_min[d], (far_plane - o_max[d]) * inv_max[d] };
+
+		//0 * inf: some ray lies on a slab plane, the axis tells nothing
+		bool nan = false;
+		for (int k = 0; k < 4; k++)
+			nan |= near_t[k] != near_t[k] || far_t[k] != far_t[k];
+		if (nan)
+			continue;
+
+		t0 = MAX(t0, MIN(MIN(near_t[0], near_t[1]), MIN(near_t[2], near_t[3])));
+		t1 = MIN(t1, MAX(MAX(far_t[0], far_t[1]), MAX(far_t[2], far_t[3])));
+	}
+	return t0 < t1;
+}
+
+/* Closest-hit traversal of a packet of rays. Each node is culled against the whole packet first (frustum test over
+   the bounds of the origins and directions), then tested against every ray with SIMD slab tests. As in Traverse,
+   the nearer child is visited first and the farther one is pushed with its entry distance, so that it is skipped
+   when every ray of the packet has found a closer hit by the time it is popped. Packets whose directions do not
+   share their signs, and nodes entered by fewer than PACKET_MIN_RAYS rays, continue with single-ray traversal.
+   The stack must hold at least getPacketStackSize() items. */
+bool BVH::TraversePacket(RayPacket& packet, Object** hit_obj, HitRecord* hit_rec, StackItem* stack) const {
+	StackItem* ray_stack = stack + getStackSize();  //second half of the stack for the single-ray traversals
+	int stack_ptr = 0;
+	bool hit = false;
+
+	if (nodes == NULL)
+		return false;
+
+	//packet bounds: direction signs, intervals of the origins and of the reciprocal directions
+	int n_rays = 0;
+	int sign[3];
+	float o_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, o_max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	float inv_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, inv_max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	bool coherent = true;
+
+	for (int i = 0; i < RAY_PACKET_SIZE; i++) {
+		if (!packet.isActive(i))
+			continue;
+		float o[3] = { packet.ox[i], packet.oy[i], packet.oz[i] };
+		float inv[3] = { packet.ix[i], packet.iy[i], packet.iz[i] };
+		if (n_rays == 0) {
+			for (int d = 0; d < 3; d++)
+				sign[d] = inv[d] < 0;
+		}
+		for (int d = 0; d < 3; d++) {
+			if ((inv[d] < 0) != (sign[d] != 0))
+				coherent = false;
+			o_min[d] = MIN(o_min[d], o[d]);
+			o_max[d] = MAX(o_max[d], o[d]);
+			inv_min[d] = MIN(inv_min[d], inv[d]);
+			inv_max[d] = MAX(inv_max[d], inv[d]);
+		}
+		n_rays++;
+	}
+
+	auto trace_single = [&](int lane, const BVHNode* start_node) {
+		Ray ray = packet.getRay(lane);
+		Vector inv_dir = Vector(packet.ix[lane], packet.iy[lane], packet.iz[lane]);
+		if (this->traverse_subtree(start_node, ray, inv_dir, packet.tmax[lane], &hit_obj[lane], hit_rec[lane], ray_stack))
+			hit = true;
+	};
+
+	if (!coherent || n_rays < PACKET_MIN_RAYS) {
+		for (int i = 0; i < RAY_PACKET_SIZE; i++)
+			if (packet.isActive(i))
+				trace_single(i, &nodes[0]);
+		return hit;
+	}
+
+	//mask of the rays that enter the node, and the nearest entry distance among them
+	auto intercepts = [&](const BVHNode* node, float& t_entry) {
+		if (!node->interceptsFrustum(o_min, o_max, inv_min, inv_max, sign))
+			return 0;
+		return node->interceptsPacket(packet, sign, t_entry);
+	};
+
+	//the farthest closest hit of the packet: a node entered beyond it holds no closer hit for any ray
+	auto max_tmax = [&]() {
+		float t = -1.0f;
+		for (int i = 0; i < RAY_PACKET_SIZE; i++)
+			t = MAX(t, packet.tmax[i]);
+		return t;
+	};
+
+	float t_entry;
+	const BVHNode* currentNode = &nodes[0];
+	int mask = intercepts(currentNode, t_entry);
+
+	while (true) {
+		int n_active = 0;
+		for (int i = 0; i < RAY_PACKET_SIZE; i++)
+			n_active += (mask >> i) & 1;
+
+		if (n_active > 0 && n_active < PACKET_MIN_RAYS) {  //the packet has diverged
+			for (int i = 0; i < RAY_PACKET_SIZE; i++)
+				if (mask & (1 << i))
+					trace_single(i, currentNode);
+		}
+
+		else if (n_active > 0 && currentNode->isLeaf()) {
+			for (int i = 0; i < RAY_PACKET_SIZE; i++) {
+				if (!(mask & (1 << i)))
+					continue;
+				Ray ray = packet.getRay(i);
+				if (this->intersect_leaf(currentNode->getIndex(), currentNode->getNObjs(), ray, packet.tmax[i], &hit_obj[i], hit_rec[i]))
+					hit = true;
 			}
 		}
 
+		else if (n_active > 0) {
+			const BVHNode* left_child = currentNode + 1;
+			const BVHNode* right_child = &this->nodes[currentNode->getIndex()];
 
-		while (true) {
-			if (this->hit_stack.empty()) {
-				return false;
+			float temp1 = 0, temp2 = 0;
+			int left_mask = intercepts(left_child, temp1);
+			int right_mask = intercepts(right_child, temp2);
+			if (left_mask && right_mask) {
+				StackItem si(left_child, temp1);
+				currentNode = right_child;
+				mask = right_mask;
+				if (temp2 > temp1) {
+					si.ptr = right_child;
+					si.t = temp2;
+					currentNode = left_child;
+					mask = left_mask;
+				}
+				stack[stack_ptr++] = si;
+				continue;
 			}
 
-			StackItem si = this->hit_stack.top();
-			currentNode = si.ptr;
-			this->hit_stack.pop();
-			break;
+			else if (left_mask || right_mask) {
+				currentNode = left_mask ? left_child : right_child;
+				mask = left_mask ? left_mask : right_mask;
+				continue;
+			}
 		}
-	}
 
-	return(false);
-}		
+		//the rays that still enter a popped node are tested again, as their closest hits may have moved nearer
+		mask = 0;
+		while (mask == 0) {
+			if (stack_ptr == 0)
+				return hit;
+
+			StackItem si = stack[--stack_ptr];
+			if (si.t < max_tmax()) {
+				currentNode = si.ptr;
+				mask = intercepts(currentNode, t_entry);
+			}
+		}
+	}
+}
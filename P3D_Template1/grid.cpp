@@ -1,6 +1,72 @@
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include "threadPool.h"
 #include "rayAccelerator.h"
 #include "macros.h"
 
+// The mailboxes of all the threads, for the stats; those of finished threads leave their counts behind
+static mutex mailboxes_mutex;
+static vector<GridMailbox*> mailboxes;
+static unsigned long long retired_tests = 0, retired_saved = 0;
+
+GridMailbox::GridMailbox() {
+	memset(stamp, 0, sizeof(stamp));
+	lock_guard<mutex> lock(mailboxes_mutex);
+	mailboxes.push_back(this);
+}
+
+GridMailbox::~GridMailbox() {
+	lock_guard<mutex> lock(mailboxes_mutex);
+	retired_tests += tests;
+	retired_saved += saved;
+	mailboxes.erase(find(mailboxes.begin(), mailboxes.end(), this));
+}
+
+GridMailbox& gridMailbox() {
+	thread_local GridMailbox mailbox;
+	return mailbox;
+}
+
+void Grid::GetStats(unsigned long long& tests, unsigned long long& saved) {
+	lock_guard<mutex> lock(mailboxes_mutex);
+	tests = retired_tests;
+	saved = retired_saved;
+	for (GridMailbox* mb : mailboxes) {
+		tests += mb->tests;
+		saved += mb->saved;
+	}
+}
+
+void Grid::ResetStats() {
+	lock_guard<mutex> lock(mailboxes_mutex);
+	retired_tests = retired_saved = 0;
+	for (GridMailbox* mb : mailboxes)
+		mb->tests = mb->saved = 0;
+}
+
+unsigned int GridMailbox::filter(const PrimitiveStore& prims, const PrimRef* refs, unsigned int n) {
+	if (untested.size() < n)
+		untested.resize(n);
+
+	unsigned int n_untested = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		if (!tested(prims.getId(refs[i])))
+			untested[n_untested++] = refs[i];
+	}
+	tests += n_untested;
+	saved += n - n_untested;
+	return n_untested;
+}
+
+// The shared primitives of the cell that the current ray has not tested yet, which are marked as tested. They
+// keep the order of the cell, sorted by type.
+Grid::CellSpan Grid::untested(CellSpan cell, GridMailbox& mailbox) const {
+	unsigned int n = mailbox.filter(prims, cell.first, cell.shared);
+	return CellSpan{ mailbox.untested.data(), n, n };
+}
+
 
 Grid::Grid(void) {}
 
@@ -15,86 +81,367 @@ void Grid::setAABB(AABB& bbox_) { this->bbox = bbox_; }
 
 void Grid::addObject(Object* o)
 {
-	objects.push_back(o);
+	o->Compile(prims);  //e.g. every face of a mesh
 }
 
 
 Object* Grid::getObject(unsigned int index)
 {
 	if (index >= 0 && index < objects.size())
-		return objects[index];
+		return prims.getOwner(objects[index]).obj;
 	return NULL;
 }
 
-// ---------------------------------------------setup_cells
-void Grid::Build(vector<Object*>& objs) {
+// runs body over [0, n) in chunks of grain on the pool, or at once without it
+static void parallel_for(ThreadPool* pool, int n, int grain, function<void(int, int)> body) {
+	if (pool != NULL)
+		pool->ParallelFor(0, n, grain, body);
+	else
+		body(0, n);
+}
 
-	int xmin, xmax;
-	int ymin, ymax;
-	int zmin, zmax;
-	int index;  	// cell's array index
+// compute the number of grid cells in the x, y, and z directions, m per object along each one at the mean density
+void Grid::setResolution(float m_) {
+	m = m_;
 
+	// dimensions of the grid in the x, y, and z directions
+	double wx = bbox.max.x - bbox.min.x;
+	double wy = bbox.max.y - bbox.min.y;
+	double wz = bbox.max.z - bbox.min.z;
+
+	double s = pow(this->getNumObjects() / (wx * wy * wz), 0.3333333);  //number of objects per unit of length
+	nx = m * wx * s + 1;
+	ny = m * wy * s + 1;
+	nz = m * wz * s + 1;
+}
+
+// cells overlapped by the bounding box of an object
+void Grid::getCellRange(const PrimRef& obj, int& ixmin, int& iymin, int& izmin, int& ixmax, int& iymax, int& izmax) const {
+	AABB obb = prims.getBounds(obj);
+
+	ixmin = clamp((obb.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
+	iymin = clamp((obb.min.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
+	izmin = clamp((obb.min.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
+	ixmax = clamp((obb.max.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
+	iymax = clamp((obb.max.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
+	izmax = clamp((obb.max.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
+}
+
+// ---------------------------------------------setup_cells
+void Grid::Build(vector<Object*>& objs, ThreadPool* pool, const vector<Ray>& sample_rays, const vector<Vector>& sample_lights) {
 
 	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 
 	AABB grid_bbox = AABB(min, max);
 
 	//build the Grid BB and //insert scene objects in the Grid objects list
-	for (Object* obj : objs) {
-		AABB o_bbox = obj->GetBoundingBox();
-		grid_bbox.extend(o_bbox);
+	for (Object* obj : objs)
 		this->addObject(obj);
+	prims.computeBounds();
+	prims.getRefs(objects);
+	for (auto& ref : objects) {
+		AABB o_bbox = prims.getBounds(ref);
+		grid_bbox.extend(o_bbox);
 	}
 	//slightly enlarge the grid box just for case
 	grid_bbox.min.x -= EPSILON; grid_bbox.min.y -= EPSILON; grid_bbox.min.z -= EPSILON;
 	grid_bbox.max.x += EPSILON; grid_bbox.max.y += EPSILON; grid_bbox.max.z += EPSILON;
 
 	this->setAABB(grid_bbox);
-	
-		
-	// dimensions of the grid in the x, y, and z directions
-	double wx = bbox.max.x - bbox.min.x;
-	double wy = bbox.max.y - bbox.min.y;
-	double wz = bbox.max.z - bbox.min.z;
 
-	// compute the number of grid cells in the x, y, and z directions
-	double s = pow(this->getNumObjects() / (wx * wy * wz), 0.3333333);  //number of objects per unit of length
-	//double s = pow(100000 / (wx * wy * wz), 0.3333333);  //number of objects per unit of length
-	nx = m * wx * s + 1;
-	ny = m * wy * s + 1;
-	nz = m * wz * s + 1;
+	setResolution(m);
+	buildCells(pool);
+
+	/* The cells at the initial m tell where the sample rays stop, and are kept when no other resolution costs less:
+	   chooseResolution then returns the initial m itself. Otherwise they are built again at the resolution of least cost. */
+	if (!sample_rays.empty() && !objects.empty()) {
+		vector<Ray> rays;
+		vector<float> t_hit;
+		traceSampleRays(sample_rays, sample_lights, pool, rays, t_hit);
+
+		float initial_m = m, initial_cost, cost;
+		float best_m = chooseResolution(rays, t_hit, pool, initial_cost, cost);
+		if (best_m != initial_m) {
+			setResolution(best_m);
+			buildCells(pool);
+		}
+		printf("\nGRID: cost model over %d sample rays (%d shadow rays) chose m = %.2f, predicted cost %.1f per ray (%.1f at m = %.2f)\n",
+			(int)rays.size(), (int)(rays.size() - sample_rays.size()), best_m, cost, initial_cost, initial_m);
+	}
+
+	prims.releaseBounds();  //only the build reads it
 
 	int cellCount = nx * ny * nz;
+	size_t cell_memory = (cell_offsets.capacity() + cell_shared.capacity()) * sizeof(unsigned int) + cell_prims.capacity() * sizeof(PrimRef);
+	printf("\nGRID: total cells = %d, total objects = %d, ResX = %d, ResY = %d, ResZ = %d, cells %.2f MB\n\n", cellCount, this->getNumObjects(), nx, ny, nz,
+		cell_memory / (1024.0 * 1024.0));
+	//Erase the vector that stores object pointers, but don't delete the objects
+	objects.erase(objects.begin(), objects.end());
+}
 
-	// set up a array to hold the objects stored in each cell
-	std::vector<Object*> obj_cell;
-	for (int i = 0; i < cellCount; i++) 
-		cells.push_back(obj_cell);   //each cell has an array with zero elements
-		
-	// insert the objects into the cells
-	for (auto &obj : objects) {   //vector iterator
-
-		AABB obb = obj->GetBoundingBox();
-
-		// Compute indices of both cells that contain min and max coord of obj bbox
-		int ixmin = clamp((obb.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
-		int iymin = clamp((obb.min.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
-		int izmin = clamp((obb.min.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
-		int ixmax = clamp((obb.max.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
-		int iymax = clamp((obb.max.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
-		int izmax = clamp((obb.max.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
-
-		// add the object to the cells
-		for (int iz = izmin; iz <= izmax; iz++) 					// cells in z direction
-			for (int iy = iymin; iy <= iymax; iy++)					// cells in y direction
-				for (int ix = ixmin; ix <= ixmax; ix++) 			// cells in x direction
-					cells[ix + nx * iy + nx * ny * iz].push_back(obj);
+/* Inserts the objects into the cells at the current resolution: the objects of every cell are counted, the counts
+   are prefix-summed into the first entry of every cell, and the objects are then inserted from there, the shared
+   ones first. Each cell receives its objects in their order, so both of its parts are sorted by type.
+   On a pool of several threads, the cells are split into slabs of layers across the axis with the most cells, and
+   every slab is counted and filled by one task from the list of the objects that overlap it, in their order. The
+   cells are thus the same as those of the serial build, whatever the number of threads, without atomics. */
+void Grid::buildCells(ThreadPool* pool) {
+
+	int n_objects = objects.size();
+	int cellCount = nx * ny * nz;
+
+	//release the cells of a previous resolution
+	vector<unsigned int>().swap(cell_offsets);
+	vector<unsigned int>().swap(cell_shared);
+	vector<PrimRef>().swap(cell_prims);
+
+	cell_offsets.assign(cellCount + 1, 0);
+	cell_shared.assign(cellCount, 0);
+	vector<unsigned int> next_shared(cellCount), next_own(cellCount);  // insertion cursors of both parts of every cell
+
+	// visits the cells of an object whose layer across axis is in [first_layer, last_layer]
+	auto for_cells = [&](const PrimRef& obj, int axis, int first_layer, int last_layer, bool insert) {
+		int lo[3], hi[3];
+		getCellRange(obj, lo[0], lo[1], lo[2], hi[0], hi[1], hi[2]);
+		bool shared = lo[0] != hi[0] || lo[1] != hi[1] || lo[2] != hi[2];
+		lo[axis] = MAX(lo[axis], first_layer);
+		hi[axis] = MIN(hi[axis], last_layer);
+		for (int iz = lo[2]; iz <= hi[2]; iz++) 					// cells in z direction
+			for (int iy = lo[1]; iy <= hi[1]; iy++)					// cells in y direction
+				for (int ix = lo[0]; ix <= hi[0]; ix++) { 			// cells in x direction
+					int index = ix + nx * iy + nx * ny * iz;
+					if (insert)
+						cell_prims[(shared ? next_shared : next_own)[index]++] = obj;
+					else {
+						cell_offsets[index + 1]++;
+						if (shared)
+							cell_shared[index]++;
+					}
+				}
+	};
+
+	if (pool == NULL || pool->getNumThreads() == 1) {
+		for (auto& obj : objects)
+			for_cells(obj, 0, 0, nx - 1, false);
+
+		// prefix sum: the first entry of every cell
+		for (int i = 0; i < cellCount; i++) {
+			cell_offsets[i + 1] += cell_offsets[i];
+			next_shared[i] = cell_offsets[i];
+			next_own[i] = cell_offsets[i] + cell_shared[i];
+		}
+
+		cell_prims.resize(cell_offsets[cellCount]);
+		for (auto& obj : objects)
+			for_cells(obj, 0, 0, nx - 1, true);
+		return;
 	}
 
+	// slabs of layers across the axis with the most cells: slab s holds the layers [slab_first[s], slab_first[s + 1])
+	int n[3] = { nx, ny, nz };
+	int axis = (nx >= ny && nx >= nz) ? 0 : (ny >= nz ? 1 : 2);
+	int n_slabs = MIN(n[axis], (int)pool->getNumThreads() * GRID_SLABS_PER_THREAD);
+	vector<int> slab_first(n_slabs + 1), slab_of(n[axis]);
+	for (int s = 0; s <= n_slabs; s++)
+		slab_first[s] = (int)((long long)s * n[axis] / n_slabs);
+	for (int s = 0; s < n_slabs; s++)
+		for (int layer = slab_first[s]; layer < slab_first[s + 1]; layer++)
+			slab_of[layer] = s;
+	auto slab_range = [&](const PrimRef& obj, int& first_slab, int& last_slab) {
+		int lo[3], hi[3];
+		getCellRange(obj, lo[0], lo[1], lo[2], hi[0], hi[1], hi[2]);
+		first_slab = slab_of[lo[axis]];
+		last_slab = slab_of[hi[axis]];
+	};
+
+	/* The objects of every slab, in their order: the objects of each fixed chunk are counted per slab, the counts are
+	   summed slab by slab and chunk by chunk within a slab, and the chunks then write their objects from there. */
+	int n_chunks = (n_objects + GRID_BUILD_CHUNK - 1) / GRID_BUILD_CHUNK;
+	vector<unsigned int> chunk_next(n_chunks * n_slabs, 0);  // entries of the chunk in each slab's list, then its cursor there
+	parallel_for(pool, n_chunks, 1, [&](int first, int last) {
+		int first_slab, last_slab;
+		for (int c = first; c < last; c++)
+			for (int i = c * GRID_BUILD_CHUNK; i < MIN((c + 1) * GRID_BUILD_CHUNK, n_objects); i++) {
+				slab_range(objects[i], first_slab, last_slab);
+				for (int s = first_slab; s <= last_slab; s++)
+					chunk_next[c * n_slabs + s]++;
+			}
+	});
+	vector<unsigned int> slab_objs_first(n_slabs + 1);
+	unsigned int n_slab_objs = 0;
+	for (int s = 0; s < n_slabs; s++) {
+		slab_objs_first[s] = n_slab_objs;
+		for (int c = 0; c < n_chunks; c++) {
+			unsigned int count = chunk_next[c * n_slabs + s];
+			chunk_next[c * n_slabs + s] = n_slab_objs;
+			n_slab_objs += count;
+		}
+	}
+	slab_objs_first[n_slabs] = n_slab_objs;
+	vector<unsigned int> slab_objs(n_slab_objs);  // indices into objects
+	parallel_for(pool, n_chunks, 1, [&](int first, int last) {
+		int first_slab, last_slab;
+		for (int c = first; c < last; c++)
+			for (int i = c * GRID_BUILD_CHUNK; i < MIN((c + 1) * GRID_BUILD_CHUNK, n_objects); i++) {
+				slab_range(objects[i], first_slab, last_slab);
+				for (int s = first_slab; s <= last_slab; s++)
+					slab_objs[chunk_next[c * n_slabs + s]++] = i;
+			}
+	});
+
+	// count the objects of the cells of every slab
+	parallel_for(pool, n_slabs, 1, [&](int first, int last) {
+		for (int s = first; s < last; s++)
+			for (unsigned int k = slab_objs_first[s]; k < slab_objs_first[s + 1]; k++)
+				for_cells(objects[slab_objs[k]], axis, slab_first[s], slab_first[s + 1] - 1, false);
+	});
+
+	// prefix sum of the cell sizes: each chunk of cells is summed, the chunk sums are scanned, and each chunk is then
+	// scanned from its first entry
+	int n_cell_chunks = (cellCount + GRID_BUILD_CHUNK - 1) / GRID_BUILD_CHUNK;
+	vector<unsigned int> chunk_first(n_cell_chunks + 1, 0);
+	parallel_for(pool, n_cell_chunks, 1, [&](int first, int last) {
+		for (int c = first; c < last; c++)
+			for (int i = c * GRID_BUILD_CHUNK; i < MIN((c + 1) * GRID_BUILD_CHUNK, cellCount); i++)
+				chunk_first[c + 1] += cell_offsets[i + 1];
+	});
+	for (int c = 0; c < n_cell_chunks; c++)
+		chunk_first[c + 1] += chunk_first[c];
+	parallel_for(pool, n_cell_chunks, 1, [&](int first, int last) {
+		for (int c = first; c < last; c++) {
+			unsigned int offset = chunk_first[c];
+			for (int i = c * GRID_BUILD_CHUNK; i < MIN((c + 1) * GRID_BUILD_CHUNK, cellCount); i++) {
+				next_shared[i] = offset;
+				next_own[i] = offset + cell_shared[i];
+				offset += cell_offsets[i + 1];
+				cell_offsets[i + 1] = offset;
+			}
+		}
+	});
+
+	// insert the objects into the cells of every slab
+	cell_prims.resize(cell_offsets[cellCount]);
+	parallel_for(pool, n_slabs, 1, [&](int first, int last) {
+		for (int s = first; s < last; s++)
+			for (unsigned int k = slab_objs_first[s]; k < slab_objs_first[s + 1]; k++)
+				for_cells(objects[slab_objs[k]], axis, slab_first[s], slab_first[s + 1] - 1, true);
+	});
+}
 
-	printf("\nGRID: total cells = %d, total objects = %d, ResX = %d, ResY = %d, ResZ = %d\n\n", cellCount, this->getNumObjects(), nx, ny, nz);
-	//Erase the vector that stores object pointers, but don't delete the objects
-	objects.erase(objects.begin(), objects.end());
+/* Traces the sample rays through the current cells, and then the shadow rays from their hits to the sample lights,
+   into rays and where they stop in t_hit: at their closest hit, or at their end. A shadow ray stops at its first
+   occluder rather than the closest one, which the cost model does not tell apart. */
+void Grid::traceSampleRays(const vector<Ray>& sample_rays, const vector<Vector>& sample_lights, ThreadPool* pool, vector<Ray>& rays, vector<float>& t_hit) {
+	auto trace = [&](int first_ray) {
+		t_hit.resize(rays.size());
+		parallel_for(pool, rays.size() - first_ray, 64, [&](int first, int last) {
+			for (int i = first_ray + first; i < first_ray + last; i++) {
+				Ray ray = rays[i];
+				Object* hit_obj;
+				HitRecord rec;
+				t_hit[i] = Traverse(ray, &hit_obj, rec) ? rec.t : ray.tmax;
+			}
+		});
+	};
+
+	rays = sample_rays;
+	trace(0);
+
+	int n_primary = rays.size();
+	for (int i = 0; i < n_primary; i++) {
+		if (t_hit[i] >= rays[i].tmax)
+			continue;
+		Vector hit = rays[i].origin + rays[i].direction * t_hit[i];
+		for (const Vector& light : sample_lights) {
+			Vector to_light = light - hit;
+			float distance = to_light.length();
+			Ray shadow = Ray(hit, to_light / distance, rays[i].time);
+			shadow.tmin = EPSILON;
+			shadow.tmax = distance;
+			rays.push_back(shadow);
+		}
+	}
+	trace(n_primary);
+}
+
+/* Cost model of the grid resolution. Each candidate factor m is charged for walking the traced rays up to where
+   they stop at its resolution: GRID_COST_STEP per cell visited and GRID_COST_TEST per primitive in those cells,
+   from the occupancies counted at that resolution. The mailbox makes a primitive met again in a later cell cheaper
+   than a test, so the finer grids are charged a bit more than they cost. Returns the factor of least cost, and the
+   mean costs per ray of it and of the current one. */
+float Grid::chooseResolution(const vector<Ray>& rays, const vector<float>& t_hit, ThreadPool* pool, float& current_cost, float& best_cost) {
+	static const float candidates[] = { 0.5f, 0.71f, 1.0f, 1.41f, 2.0f, 2.83f, 4.0f };
+	int n_rays = rays.size();
+	float current_m = m;
+
+	// mean cost per ray at the current resolution, with cell_size(index) objects in every cell
+	auto predicted_cost = [&](const auto& cell_size) {
+		double cells = 0.0, tests = 0.0;
+		for (int i = 0; i < n_rays; i++) {
+			int ix, iy, iz;
+			double 	tx_next, ty_next, tz_next;
+			double dtx, dty, dtz;
+			int 	ix_step, iy_step, iz_step;
+			int 	ix_stop, iy_stop, iz_stop;
+
+			Ray ray = rays[i];
+			if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
+				continue;
+			while (true) {
+				cells += 1.0;
+				tests += cell_size(ix + nx * iy + nx * ny * iz);
+				if (MIN3(tx_next, ty_next, tz_next) >= t_hit[i])
+					break;
+				if (tx_next < ty_next && tx_next < tz_next) {
+					tx_next += dtx;
+					ix += ix_step;
+					if (ix == ix_stop) break;
+				}
+				else if (ty_next < tz_next) {
+					ty_next += dty;
+					iy += iy_step;
+					if (iy == iy_stop) break;
+				}
+				else {
+					tz_next += dtz;
+					iz += iz_step;
+					if (iz == iz_stop) break;
+				}
+			}
+		}
+		return (float)((GRID_COST_STEP * cells + GRID_COST_TEST * tests) / n_rays);
+	};
+
+	// the current cells are built: their sizes give the cost of keeping them
+	current_cost = predicted_cost([this](int index) { return cell_offsets[index + 1] - cell_offsets[index]; });
+
+	float best_m = current_m;
+	best_cost = current_cost;
+	for (float candidate_m : candidates) {
+		setResolution(candidate_m);
+		int cellCount = nx * ny * nz;
+
+		// objects per cell, as the cells would hold them
+		unique_ptr<atomic<unsigned int>[]> counts(new atomic<unsigned int>[cellCount]());
+		parallel_for(pool, objects.size(), GRID_BUILD_CHUNK, [&](int first, int last) {
+			int ixmin, iymin, izmin, ixmax, iymax, izmax;
+			for (int i = first; i < last; i++) {
+				getCellRange(objects[i], ixmin, iymin, izmin, ixmax, iymax, izmax);
+				for (int iz = izmin; iz <= izmax; iz++)
+					for (int iy = iymin; iy <= iymax; iy++)
+						for (int ix = ixmin; ix <= ixmax; ix++)
+							counts[ix + nx * iy + nx * ny * iz].fetch_add(1, memory_order_relaxed);
+			}
+		});
+
+		float cost = predicted_cost([&counts](int index) { return counts[index].load(memory_order_relaxed); });
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_m = candidate_m;
+		}
+	}
+	setResolution(current_m);
+	return best_m;
 }
 
 //Setup function for Grid traversal according to Amanatides&Woo algorithm
@@ -245,7 +592,7 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 }
 
 //-----------------------------------------------------------------------GRID TRAVERSAL
-bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
+bool Grid::Traverse(Ray& ray, Object **hitobject, HitRecord& hit) {
 	int ix, iy, iz;
 	double 	tx_next, ty_next, tz_next;
 	double dtx, dty, dtz; 
@@ -257,50 +604,60 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
 		return false;   //ray does not intersect the Grid bounding box
 
-	std::vector<Object*> objs;
-	float closestDistance;
 	Object* closestObj = NULL;
-	float distance;
-	
+	HitRecord closestRec;
+	GridMailbox& mailbox = gridMailbox();
+	mailbox.newRay();
+
+	/* Only hits closer than ray.tmax count (e.g. closer than an unbounded object already hit), so the cells beyond
+	   it are skipped. The closest hit is kept across the cells: a primitive skipped by the mailbox was tested in an
+	   earlier cell, and its hit, if beyond that cell, is still the candidate. Any hit closer than the exit of the
+	   current cell lies in it, so the result is the same as testing the whole cell. */
+	float closestDistance = ray.tmax;
+	bool cellHit = false;
 	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
-
-		closestDistance = FLT_MAX;
-		if (objs.size() != 0) 
-			for (auto obj : objs) //intersect Ray with all objects and find the closest hit point(if any)
-				if (obj->intercepts(ray, distance) && distance < closestDistance) {
-					closestDistance = distance;
-					closestObj = obj;
-				}
+		CellSpan objs = getCell(ix, iy, iz);
+
+		if (objs.count != 0) {  //intersect Ray with all objects and find the closest hit point(if any)
+			CellSpan shared = untested(objs, mailbox);
+			if (shared.count != 0 && prims.intersect(shared.first, shared.count, ray, closestDistance, &closestObj, closestRec))
+				cellHit = true;
+			mailbox.tests += objs.count - objs.shared;
+			if (objs.count != objs.shared && prims.intersect(objs.first + objs.shared, objs.count - objs.shared, ray, closestDistance, &closestObj, closestRec))
+				cellHit = true;
+		}
 		
 		if (tx_next < ty_next && tx_next < tz_next) {
-			if (closestDistance < tx_next) {
+			if (cellHit && closestDistance < tx_next) {
 					*hitobject = closestObj;
-					hitpoint = ray.origin +ray.direction * closestDistance;
+					hit = closestRec;
 					return true;
 			}
+			if (tx_next >= ray.tmax) return (false);
 			tx_next += dtx;
 			ix += ix_step;
 			if (ix == ix_stop) return (false);
 		}
 
 		else if (ty_next < tz_next) {
-				if (closestDistance < ty_next) {
+				if (cellHit && closestDistance < ty_next) {
 					*hitobject = closestObj;
-					hitpoint = ray.origin + ray.direction * closestDistance;
+					hit = closestRec;
 					return true;
 				}
+				if (ty_next >= ray.tmax) return (false);
 				ty_next += dty;
 				iy += iy_step;
 				if (iy == iy_stop) return (false);
 		}
 
 		else {
-			if (closestDistance < tz_next) {
+			if (cellHit && closestDistance < tz_next) {
 				*hitobject = closestObj;
-				hitpoint = ray.origin + ray.direction * closestDistance;
+				hit = closestRec;
 				return true;
 			}
+			if (tz_next >= ray.tmax) return (false);
 			tz_next += dtz;
 			iz += iz_step;
 			if (iz == iz_stop) return (false);
@@ -310,10 +667,7 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 }
 
 //-----------------------------------------------------------------------GRID TRAVERSAL FOR SHADOW RAY
-bool Grid::Traverse(Ray& ray) {  
-
-	double length = ray.direction.length(); //distance between light and intersection point
-	ray.direction.normalize();
+bool Grid::Occluded(Ray& ray) {
 
 	int ix, iy, iz;
 	double 	tx_next, ty_next, tz_next;
@@ -323,22 +677,34 @@ bool Grid::Traverse(Ray& ray) {
 	int 	ix_stop, iy_stop, iz_stop;
 
 	/*Calculate the initial cell as well as the ray parameter increments per cell in the x, y, and z directions
-	Shadow ray always intersect the Grid bounding box. However due to rounding it may starts at the boundaries, which may result as no intersecting. Consider it as in shadow. */
+	A ray that misses the bounding box, such as a shadow ray from a plane outside of the Grid, meets none of its objects.
+	The unbounded objects are not in the Grid: occluded() in main.cpp tests them before asking the Grid, as the
+	closest-hit path does with intersectUnbounded(). The Grid used to count a miss as in shadow, as a rounding error
+	at its boundary when every shadow ray started on an object inside it; a ray leaving through the boundary has no
+	occluder in the Grid either. */
 	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
-		return true;
+		return false;
 
-	std::vector<Object*> objs;
-	float distance;
+	//a primitive that did not occlude the ray in one cell does not occlude it in the next ones
+	GridMailbox& mailbox = gridMailbox();
+	mailbox.newRay();
 
 	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
-		if (objs.size() != 0) 
+		CellSpan objs = getCell(ix, iy, iz);
+		if (objs.count != 0) {
 			//intersect Ray with all objects of each cell
-			for (auto &obj : objs) {
-				if (obj->intercepts(ray, distance) && distance < length) 
-					return true;
-			}
-		
+			CellSpan shared = untested(objs, mailbox);
+			if (shared.count != 0 && prims.occluded(shared.first, shared.count, ray))
+				return true;
+			mailbox.tests += objs.count - objs.shared;
+			if (objs.count != objs.shared && prims.occluded(objs.first + objs.shared, objs.count - objs.shared, ray))
+				return true;
+		}
+
+		//the end of the ray (e.g. the light) lies in this cell: no cell beyond it can hold an occluder
+		if (MIN3(tx_next, ty_next, tz_next) >= ray.tmax)
+			return (false);
+
 		if (tx_next < ty_next && tx_next < tz_next) {
 			tx_next += dtx;
 			ix += ix_step;
@@ -0,0 +1,292 @@
+#include <algorithm>
+#include "threadPool.h"
+#include "rayAccelerator.h"
+#include "macros.h"
+
+HierarchicalGrid::HierarchicalGrid(void) {}
+
+int HierarchicalGrid::getNumObjects()
+{
+	return prims.size();
+}
+
+size_t HierarchicalGrid::Level::getMemorySize() const {
+	return (cell_offsets.capacity() + cell_shared.capacity()) * sizeof(unsigned int) + cell_prims.capacity() * sizeof(PrimRef);
+}
+
+// ---------------------------------------------setup_cells of one level
+void HierarchicalGrid::buildLevel(Level& level, const AABB& bbox, const PrimRef* refs, unsigned int n, unsigned int n_shared, float m) {
+
+	level.bbox = bbox;
+
+	// dimensions of the level in the x, y, and z directions
+	double wx = bbox.max.x - bbox.min.x;
+	double wy = bbox.max.y - bbox.min.y;
+	double wz = bbox.max.z - bbox.min.z;
+
+	double s = pow(n / (wx * wy * wz), 0.3333333);  //number of objects per unit of length
+	int nx = level.nx = m * wx * s + 1;
+	int ny = level.ny = m * wy * s + 1;
+	int nz = level.nz = m * wz * s + 1;
+	level.cell_size = Vector(wx / nx, wy / ny, wz / nz);
+
+	int cellCount = nx * ny * nz;
+
+	// cells overlapped by the bounding box of an object, clipped to the level
+	auto cell_range = [&](const PrimRef& obj, int& ixmin, int& iymin, int& izmin, int& ixmax, int& iymax, int& izmax) {
+		AABB obb = prims.getBounds(obj);
+
+		ixmin = clamp((obb.min.x - bbox.min.x) * nx / wx, 0, nx - 1);
+		iymin = clamp((obb.min.y - bbox.min.y) * ny / wy, 0, ny - 1);
+		izmin = clamp((obb.min.z - bbox.min.z) * nz / wz, 0, nz - 1);
+		ixmax = clamp((obb.max.x - bbox.min.x) * nx / wx, 0, nx - 1);
+		iymax = clamp((obb.max.y - bbox.min.y) * ny / wy, 0, ny - 1);
+		izmax = clamp((obb.max.z - bbox.min.z) * nz / wz, 0, nz - 1);
+	};
+	int ixmin, iymin, izmin, ixmax, iymax, izmax;
+
+	// count the objects of every cell, after the offset of the cell that precedes it, and those shared with other cells
+	level.cell_offsets.assign(cellCount + 1, 0);
+	level.cell_shared.assign(cellCount, 0);
+	for (unsigned int i = 0; i < n; i++) {
+		cell_range(refs[i], ixmin, iymin, izmin, ixmax, iymax, izmax);
+		bool shared = i < n_shared || ixmin != ixmax || iymin != iymax || izmin != izmax;
+		for (int iz = izmin; iz <= izmax; iz++)
+			for (int iy = iymin; iy <= iymax; iy++)
+				for (int ix = ixmin; ix <= ixmax; ix++) {
+					level.cell_offsets[ix + nx * iy + nx * ny * iz + 1]++;
+					if (shared)
+						level.cell_shared[ix + nx * iy + nx * ny * iz]++;
+				}
+	}
+
+	// prefix sum: the first entry of every cell
+	for (int i = 0; i < cellCount; i++)
+		level.cell_offsets[i + 1] += level.cell_offsets[i];
+
+	/* insert the objects into the cells, the shared ones first, in the order of refs. The top level gets them sorted
+	   by type, as getRefs returns them; a sub-grid cell may not, since its shared part takes the first n_shared refs and
+	   then the later ones that straddle its cells. PrimitiveStore only groups consecutive refs of the same type into a
+	   run, so the result is the same either way, with shorter runs. */
+	level.cell_prims.resize(level.cell_offsets[cellCount]);
+	vector<unsigned int> next_shared(level.cell_offsets.begin(), level.cell_offsets.end() - 1), next_own(cellCount);
+	for (int i = 0; i < cellCount; i++)
+		next_own[i] = level.cell_offsets[i] + level.cell_shared[i];
+	for (unsigned int i = 0; i < n; i++) {
+		cell_range(refs[i], ixmin, iymin, izmin, ixmax, iymax, izmax);
+		bool shared = i < n_shared || ixmin != ixmax || iymin != iymax || izmin != izmax;
+		vector<unsigned int>& next = shared ? next_shared : next_own;
+		for (int iz = izmin; iz <= izmax; iz++)
+			for (int iy = iymin; iy <= iymax; iy++)
+				for (int ix = ixmin; ix <= ixmax; ix++)
+					level.cell_prims[next[ix + nx * iy + nx * ny * iz]++] = refs[i];
+	}
+}
+
+void HierarchicalGrid::Build(vector<Object*>& objs, ThreadPool* pool) {
+
+	for (Object* obj : objs)
+		obj->Compile(prims);  //e.g. every face of a mesh
+	prims.computeBounds();
+	vector<PrimRef> objects;
+	prims.getRefs(objects);
+
+	AABB grid_bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for (auto& ref : objects)
+		grid_bbox.extend(prims.getBounds(ref));
+	//slightly enlarge the grid box just for case
+	grid_bbox.min.x -= EPSILON; grid_bbox.min.y -= EPSILON; grid_bbox.min.z -= EPSILON;
+	grid_bbox.max.x += EPSILON; grid_bbox.max.y += EPSILON; grid_bbox.max.z += EPSILON;
+
+	buildLevel(top, grid_bbox, objects.data(), objects.size(), 0, m_top);
+	objects.clear();
+	objects.shrink_to_fit();
+
+	/* Give every overfull top cell a sub-grid over it, built from the primitives of the cell: those shared with
+	   other top cells stay shared in all its sub-cells. The sub-grids only read the top cells, so they are built
+	   in parallel, before the remaining top cells are compacted in place. */
+	int nx = top.nx, ny = top.ny;
+	int cellCount = top.nx * top.ny * top.nz;
+	top_sub.assign(cellCount, -1);
+	vector<int> sub_cells;  // top cell of every sub-grid
+	for (int i = 0; i < cellCount; i++)
+		if (top.cell_offsets[i + 1] - top.cell_offsets[i] > HGRID_MAX_CELL_PRIMS) {
+			top_sub[i] = sub_cells.size();
+			sub_cells.push_back(i);
+		}
+
+	subgrids.clear();
+	subgrids.resize(sub_cells.size());
+	auto build_subgrids = [&](int first, int last) {
+		for (int k = first; k < last; k++) {
+			int i = sub_cells[k];
+			unsigned int first_prim = top.cell_offsets[i], count = top.cell_offsets[i + 1] - first_prim;
+			Vector cell_min = top.bbox.min + Vector((i % nx) * top.cell_size.x, (i / nx % ny) * top.cell_size.y, (i / (nx * ny)) * top.cell_size.z);
+			buildLevel(subgrids[k], AABB(cell_min, cell_min + top.cell_size), &top.cell_prims[first_prim], count, top.cell_shared[i], m);
+		}
+	};
+	if (pool != NULL)
+		pool->ParallelFor(0, sub_cells.size(), 1, build_subgrids);
+	else
+		build_subgrids(0, sub_cells.size());
+
+	unsigned int first = 0, n_kept = 0;
+	for (int i = 0; i < cellCount; i++) {
+		unsigned int end = top.cell_offsets[i + 1];
+		if (top_sub[i] >= 0)
+			top.cell_shared[i] = 0;
+		else {
+			copy(top.cell_prims.begin() + first, top.cell_prims.begin() + end, top.cell_prims.begin() + n_kept);
+			n_kept += end - first;
+		}
+		top.cell_offsets[i + 1] = n_kept;
+		first = end;
+	}
+	top.cell_prims.resize(n_kept);
+	top.cell_prims.shrink_to_fit();
+	prims.releaseBounds();  //only the build reads it
+
+	size_t cell_memory = top.getMemorySize() + top_sub.capacity() * sizeof(int);
+	int subCellCount = 0;
+	for (const Level& level : subgrids) {
+		cell_memory += level.getMemorySize();
+		subCellCount += level.nx * level.ny * level.nz;
+	}
+	printf("\nHGRID: top cells = %d, ResX = %d, ResY = %d, ResZ = %d, %d sub-grids with %d cells, total objects = %d, cells %.2f MB\n\n",
+		cellCount, top.nx, top.ny, top.nz, (int)subgrids.size(), subCellCount, this->getNumObjects(), cell_memory / (1024.0 * 1024.0));
+}
+
+//Amanatides&Woo walk of the cells of one level, clipped to its bounding box
+template <class Visit>
+bool HierarchicalGrid::walk(const Level& level, const Ray& ray, float t0, float t1, Visit visit) const {
+
+	const float o[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	const float d[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+	const float lo[3] = { level.bbox.min.x, level.bbox.min.y, level.bbox.min.z };
+	const float hi[3] = { level.bbox.max.x, level.bbox.max.y, level.bbox.max.z };
+	const float size[3] = { level.cell_size.x, level.cell_size.y, level.cell_size.z };
+	const int n[3] = { level.nx, level.ny, level.nz };
+
+	for (int a = 0; a < 3; a++) {
+		if (d[a] == 0.0f) {  //parallel to the slab
+			if (o[a] < lo[a] || o[a] > hi[a])
+				return false;
+			continue;
+		}
+		float ta = (lo[a] - o[a]) / d[a];
+		float tb = (hi[a] - o[a]) / d[a];
+		t0 = MAX(t0, MIN(ta, tb));
+		t1 = MIN(t1, MAX(ta, tb));
+	}
+	if (t0 > t1)   //the ray misses the level in [t0, t1]
+		return false;
+
+	// initial cell, and the ray parameter at the next cell boundary and the increments per cell along every axis
+	int cell[3], step[3], stop[3];
+	float t_next[3], dt[3];
+	for (int a = 0; a < 3; a++) {
+		cell[a] = clamp((o[a] + d[a] * t0 - lo[a]) / size[a], 0, n[a] - 1);
+		if (d[a] > 0) {
+			t_next[a] = (lo[a] + (cell[a] + 1) * size[a] - o[a]) / d[a];
+			dt[a] = size[a] / d[a];
+			step[a] = +1;
+			stop[a] = n[a];
+		}
+		else if (d[a] < 0) {
+			t_next[a] = (lo[a] + cell[a] * size[a] - o[a]) / d[a];
+			dt[a] = -size[a] / d[a];
+			step[a] = -1;
+			stop[a] = -1;
+		}
+		else {
+			t_next[a] = FLT_MAX;
+			dt[a] = 0.0f;
+			step[a] = 0;
+			stop[a] = -1;
+		}
+	}
+
+	float t_in = t0;
+	while (true) {
+		int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+		float t_out = MIN(t_next[a], t1);
+		if (visit(cell[0] + n[0] * cell[1] + n[0] * n[1] * cell[2], t_in, t_out))
+			return true;
+		if (t_next[a] >= t1) return false;
+		cell[a] += step[a];
+		if (cell[a] == stop[a]) return false;
+		t_in = t_next[a];
+		t_next[a] += dt[a];
+	}
+}
+
+//-----------------------------------------------------------------------HIERARCHICAL GRID TRAVERSAL
+bool HierarchicalGrid::Traverse(Ray& ray, Object** hitobject, HitRecord& hit) {
+
+	Object* closestObj = NULL;
+	HitRecord closestRec;
+	GridMailbox& mailbox = gridMailbox();
+	mailbox.newRay();
+
+	// The closest hit is kept across the cells of both levels, as in Grid::Traverse: the walk stops at the first
+	// cell whose exit lies beyond it.
+	float closestDistance = ray.tmax;
+	bool cellHit = false;
+	auto test_cell = [&](const Level& level, int index, float t_out) {
+		unsigned int count = level.cell_offsets[index + 1] - level.cell_offsets[index], shared = level.cell_shared[index];
+		const PrimRef* objs = level.cell_prims.data() + level.cell_offsets[index];
+
+		if (count != 0) {
+			unsigned int n = mailbox.filter(prims, objs, shared);
+			if (n != 0 && prims.intersect(mailbox.untested.data(), n, ray, closestDistance, &closestObj, closestRec))
+				cellHit = true;
+			mailbox.tests += count - shared;
+			if (count != shared && prims.intersect(objs + shared, count - shared, ray, closestDistance, &closestObj, closestRec))
+				cellHit = true;
+		}
+		return cellHit && closestDistance < t_out;
+	};
+
+	walk(top, ray, 0.0f, ray.tmax, [&](int index, float t_in, float t_out) {
+		if (top_sub[index] < 0)
+			return test_cell(top, index, t_out);
+		const Level& sub = subgrids[top_sub[index]];
+		return walk(sub, ray, t_in, t_out, [&](int sub_index, float, float sub_t_out) { return test_cell(sub, sub_index, sub_t_out); });
+	});
+
+	// a hit found in the last cells may lie just beyond them by rounding: it is still the closest one
+	if (!cellHit)
+		return false;
+	*hitobject = closestObj;
+	hit = closestRec;
+	return true;
+}
+
+//-----------------------------------------------------------------------HIERARCHICAL GRID TRAVERSAL FOR SHADOW RAY
+bool HierarchicalGrid::Occluded(Ray& ray) {
+
+	//a primitive that did not occlude the ray in one cell does not occlude it in the next ones
+	GridMailbox& mailbox = gridMailbox();
+	mailbox.newRay();
+
+	auto test_cell = [&](const Level& level, int index) {
+		unsigned int count = level.cell_offsets[index + 1] - level.cell_offsets[index], shared = level.cell_shared[index];
+		const PrimRef* objs = level.cell_prims.data() + level.cell_offsets[index];
+
+		if (count == 0)
+			return false;
+		unsigned int n = mailbox.filter(prims, objs, shared);
+		if (n != 0 && prims.occluded(mailbox.untested.data(), n, ray))
+			return true;
+		mailbox.tests += count - shared;
+		return count != shared && prims.occluded(objs + shared, count - shared, ray);
+	};
+
+	// the walks end at ray.tmax (e.g. the light): no cell beyond it can hold an occluder
+	return walk(top, ray, 0.0f, ray.tmax, [&](int index, float t_in, float t_out) {
+		if (top_sub[index] < 0)
+			return test_cell(top, index);
+		const Level& sub = subgrids[top_sub[index]];
+		return walk(sub, ray, t_in, t_out, [&](int sub_index, float, float) { return test_cell(sub, sub_index); });
+	});
+}
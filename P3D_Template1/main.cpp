@@ -22,6 +22,7 @@
 
 #include "scene.h"
 #include "rayAccelerator.h"
+#include "threadPool.h"
 #include "maths.h"
 #include "macros.h"
 
@@ -38,6 +39,8 @@ bool P3F_scene = true; //choose between P3F scene or a built-in random scene
 #define BIAS 0.001
 #define JITT_SAMPLES 4
 #define LENS_SAMPLES 8
+#define TILE_SIZE 16
+#define GRID_SAMPLE_RAYS 32  // side of the pixel grid whose primary rays, with their shadow rays, drive the choice of the grid resolution
 
 unsigned int FrameCount = 0;
 
@@ -84,8 +87,15 @@ Scene* scene = NULL;
 
 Grid* grid_ptr = NULL;
 BVH* bvh_ptr = NULL;
+WideBVH* wbvh_ptr = NULL;
+MotionBVH* mbvh_ptr = NULL;
+HierarchicalGrid* hgrid_ptr = NULL;
 accelerator Accel_Struct = NONE;
 
+// Render threads: 0 uses all hardware threads. Set with the command line option "-threads <n>".
+unsigned int n_threads = 0;
+ThreadPool* pool_ptr = NULL;
+
 int RES_X, RES_Y;
 
 int WindowHandle = 0;
@@ -98,8 +108,14 @@ bool progressive =  false;
 bool dof = true;
 bool motion_blur = false;
 
+// Moves the animated objects of the scene every frame and refits the BVH, or rebuilds the other accelerators (key 'a')
+bool animation = false;
+
 float roughness = 2.0f;
 
+// Frame number used as a key of the per-pixel random number generator
+unsigned int frame_index = 0;
+
 
 /////////////////////////////////////////////////////////////////////// ERRORS
 
@@ -348,6 +364,11 @@ void processKeys(unsigned char key, int xx, int yy)
 	case 'j':
 		jittering = !jittering;
 		break;
+
+	case 'a':
+		animation = !animation;
+		printf("Animation %s\n", animation ? "on" : "off");
+		break;
 	}
 }
 
@@ -473,10 +494,157 @@ void setupGLUT(int argc, char* argv[])
 
 /////////////////////////////////////////////////////YOUR CODE HERE///////////////////////////////////////////////////////////////////////////////////////
 
+/************************************************ BVH Traversal Stack **************************************************/
+// One traversal stack per thread, grown to the depth of the current BVH (twice the depth for packets)
+BVH::StackItem* bvhStack() {
+	thread_local vector<BVH::StackItem> stack;
+
+	if (stack.size() < (size_t)bvh_ptr->getPacketStackSize())
+		stack.resize(bvh_ptr->getPacketStackSize());
+	return stack.data();
+}
+
+WideBVH::StackItem* wbvhStack() {
+	thread_local vector<WideBVH::StackItem> stack;
+
+	if (stack.size() < (size_t)wbvh_ptr->getStackSize())
+		stack.resize(wbvh_ptr->getStackSize());
+	return stack.data();
+}
+
+MotionBVH::StackItem* mbvhStack() {
+	thread_local vector<MotionBVH::StackItem> stack;
+
+	if (stack.size() < (size_t)mbvh_ptr->getStackSize())
+		stack.resize(mbvh_ptr->getStackSize());
+	return stack.data();
+}
+/***********************************************************************************************************************/
+
+/************************************************ Unbounded Objects **************************************************/
+// Objects without a finite bounding box (planes) are not built into the acceleration structure, whose bounds stay
+// tight around the finite geometry. They are tested analytically before the traversal, which then only looks
+// for hits closer than theirs.
+vector<Object*> unbounded_objs;
+
+// Splits the scene objects into the ones for the acceleration structure and the unbounded ones
+void getAcceleratedObjects(vector<Object*>& objs) {
+	for (int o = 0; o < scene->getNumObjects(); o++) {
+		Object* obj = scene->getObject(o);
+		if (obj->IsUnbounded())
+			unbounded_objs.push_back(obj);
+		else
+			objs.push_back(obj);
+	}
+	if (unbounded_objs.size() != 0)
+		printf("%d unbounded objects kept out of the acceleration structure.\n", (int)unbounded_objs.size());
+}
+
+/* Builds the acceleration structure Accel_Struct over the bounded objects of the scene, replacing that of a previous
+   scene or frame: the dispatch tests these pointers. */
+void buildAccelerator() {
+	delete grid_ptr; grid_ptr = NULL;
+	delete hgrid_ptr; hgrid_ptr = NULL;
+	delete bvh_ptr; bvh_ptr = NULL;
+	delete wbvh_ptr; wbvh_ptr = NULL;
+	delete mbvh_ptr; mbvh_ptr = NULL;
+	unbounded_objs.clear();
+
+	// runs the build of the accelerator and reports its time
+	auto timedBuild = [](const char* name, const auto& build) {
+		auto buildStart = std::chrono::high_resolution_clock::now();
+		build();
+		auto buildTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - buildStart).count();
+		printf("%s built in %.2f ms.\n\n", name, buildTime);
+	};
+
+	vector<Object*> objs;
+	if (Accel_Struct != NONE)
+		getAcceleratedObjects(objs);
+
+	if (Accel_Struct == GRID_ACC) {
+		grid_ptr = new Grid();
+		vector<Ray> sample_rays;
+		Camera* cam = scene->GetCamera();
+		for (int y = 0; y < GRID_SAMPLE_RAYS; y++)
+			for (int x = 0; x < GRID_SAMPLE_RAYS; x++)
+				sample_rays.push_back(cam->PrimaryRay(Vector((x + 0.5f) * cam->GetResX() / GRID_SAMPLE_RAYS, (y + 0.5f) * cam->GetResY() / GRID_SAMPLE_RAYS, 0.0f)));
+		//the shadow rays go to the light positions; the pinhole rays stand for the lens rays of depth of field, and the
+		//reflected and refracted rays are not sampled
+		vector<Vector> sample_lights;
+		for (int i = 0; i < scene->getNumLights(); i++)
+			sample_lights.push_back(scene->getLight(i)->position);
+		timedBuild("Grid", [&]() { grid_ptr->Build(objs, pool_ptr, sample_rays, sample_lights); });
+	}
+	else if (Accel_Struct == BVH_ACC) {
+		bvh_ptr = new BVH();
+		timedBuild("BVH", [&]() { bvh_ptr->Build(objs, pool_ptr); });
+	}
+	else if (Accel_Struct == WBVH_ACC) {
+		wbvh_ptr = new WideBVH();
+		timedBuild("Wide BVH", [&]() { wbvh_ptr->Build(objs, pool_ptr); });
+	}
+	else if (Accel_Struct == MBVH_ACC) {
+		mbvh_ptr = new MotionBVH();
+		timedBuild("Motion BVH", [&]() { mbvh_ptr->Build(objs, pool_ptr); });
+	}
+	else if (Accel_Struct == HGRID_ACC) {
+		hgrid_ptr = new HierarchicalGrid();
+		timedBuild("Two-level grid", [&]() { hgrid_ptr->Build(objs, pool_ptr); });
+	}
+	else
+		printf("No acceleration data structure.\n\n");
+}
+
+// Closest hit among the unbounded objects in [ray.tmin, ray.tmax]; clamps ray.tmax to it
+bool intersectUnbounded(Ray& ray, Object** hit_obj, HitRecord& hit_rec) {
+	bool hit = false;
+
+	for (Object* obj : unbounded_objs) {
+		HitRecord rec;
+		if (obj->intercepts(ray, rec) && rec.t > ray.tmin && rec.t < ray.tmax) {
+			ray.tmax = rec.t;
+			*hit_obj = obj;
+			hit_rec = rec;
+			hit = true;
+		}
+	}
+	return hit;
+}
+/***********************************************************************************************************************/
+
+/*************************************************** Shadow Rays ******************************************************/
+// Any-hit query through the active acceleration structure: is there an object in [ray.tmin, ray.tmax]?
+bool occluded(Ray& ray) {
+	for (Object* obj : unbounded_objs) {
+		if (obj->occludes(ray))
+			return true;
+	}
+
+	if (bvh_ptr != NULL)
+		return bvh_ptr->Occluded(ray, bvhStack());
+	if (wbvh_ptr != NULL)
+		return wbvh_ptr->Occluded(ray, wbvhStack());
+	if (mbvh_ptr != NULL)
+		return mbvh_ptr->Occluded(ray, mbvhStack());
+	if (grid_ptr != NULL)
+		return grid_ptr->Occluded(ray);
+	if (hgrid_ptr != NULL)
+		return hgrid_ptr->Occluded(ray);
+
+	for (int i = 0; i < scene->getNumObjects(); i++) {
+		Object* obj = scene->getObject(i);
+		if (obj->occludes(ray))
+			return true;
+	}
+	return false;
+}
+/***********************************************************************************************************************/
+
 /*************************************************** Calculate Color ****************************************************/
-Color calculateColor(Vector normal, Light* light, Vector light_dir, Vector view_dir, Material* mat, Vector pos) {
+Color calculateColor(Vector normal, Light* light, Vector light_pos, Vector light_dir, Vector view_dir, Material* mat, Vector pos, float time) {
 	Vector halfway_dir = (light_dir - view_dir).normalize();
-	float distance = (light->position - pos).length();
+	float distance = (light_pos - pos).length();
 
 	float diff = max(normal * light_dir, 0);
 	Color diffuse = light->color * diff * mat->GetDiffColor() * mat->GetDiffuse();
@@ -484,24 +652,13 @@ Color calculateColor(Vector normal, Light* light, Vector light_dir, Vector view_
 	float spec = pow(max((normal * halfway_dir), 0.0), mat->GetShine());
 	Color specular = mat->GetSpecColor() * spec * light->color * mat->GetSpecular();
 
-	Ray r = Ray(pos, light_dir);
+	//light_dir is normalized, so the shadow ray ends at the light after distance units
+	Ray r = Ray(pos, light_dir, time);
+	r.tmax = distance;
+
+	if (occluded(r))
+		return Color(0, 0, 0);
 
-	if (bvh_ptr != NULL) {
-		if (bvh_ptr->Traverse(r))
-			return Color(0, 0, 0);
-	}
-	else if (grid_ptr != NULL) {
-		if (grid_ptr->Traverse(r))
-			return Color(0, 0, 0);
-	}
-	else {
-		for (int i = 0; i < scene->getNumObjects(); i++) {
-			Object* obj = scene->getObject(i);
-			float dist = 0.0f;
-			if (obj->intercepts(r, dist))
-				return Color(0, 0, 0);
-		}
-	}
 	Color c = (diffuse + specular) / (scene->getNumLights() * 0.9f);
 	return c;
 }
@@ -509,26 +666,26 @@ Color calculateColor(Vector normal, Light* light, Vector light_dir, Vector view_
 
 /************************************************ Object Intersection **************************************************/
 
-Object* closestObject(Ray ray, float &t) {
+Object* closestObject(Ray ray, HitRecord& hit_rec) {
 	float minDist = INFINITY;
 	Object* closest = NULL;
 
 	for (int i = 0; i < scene->getNumObjects(); i++) {
 		Object* obj = scene->getObject(i);
-		float dist = 0.0f;
-		if (obj->intercepts(ray, dist)) {
-			if (dist < minDist) {
+		HitRecord rec;
+		if (obj->intercepts(ray, rec)) {
+			if (rec.t < minDist) {
 				closest = obj;
-				minDist = dist;
+				minDist = rec.t;
+				hit_rec = rec;
 			}
 		}
 	}
-	t = minDist;
 	return closest;
 }
 /***********************************************************************************************************************/
 
-Color lightReflection(Vector l_pos, Vector phit, Vector normal, Vector ray_dir, Material* mat, Light* l) {
+Color lightReflection(Vector l_pos, Vector phit, Vector normal, Vector ray_dir, Material* mat, Light* l, float time) {
 	Vector light_direction = (l_pos - phit).normalize();
 
 	float intensity = light_direction * normal;
@@ -537,24 +694,24 @@ Color lightReflection(Vector l_pos, Vector phit, Vector normal, Vector ray_dir,
 	reflection = reflection.normalize();
 
 	if (intensity > 0) {
-		return calculateColor(normal, l, light_direction, ray_dir, mat, phit + normal * BIAS);
+		return calculateColor(normal, l, l_pos, light_direction, ray_dir, mat, phit + normal * BIAS, time);
 	}
 	return Color(0,0,0);
 }
 
-Vector chooseGridCoords(Vector pos, Light* l = nullptr, int k = 0, int j = 0) {
+Vector chooseGridCoords(Vector pos, Sampler& sampler, Light* l = nullptr, int k = 0, int j = 0) {
 
 	if (l != nullptr && k == 0 && j == 0) {
-		pos.x = pos.x - 0.5 + rand_float() * (float)l->width;
-		pos.y = pos.y - 0.5 + rand_float() * (float)l->height;
+		pos.x = pos.x - 0.5 + rand_float(sampler) * (float)l->width;
+		pos.y = pos.y - 0.5 + rand_float(sampler) * (float)l->height;
 	}
 	else if(l != nullptr) {
-		pos.x = pos.x - 0.5 + (k + rand_float()) * l->width / JITT_SAMPLES;
-		pos.y = pos.y - 0.5 + (j + rand_float()) * l->height / JITT_SAMPLES;
+		pos.x = pos.x - 0.5 + (k + rand_float(sampler)) * l->width / JITT_SAMPLES;
+		pos.y = pos.y - 0.5 + (j + rand_float(sampler)) * l->height / JITT_SAMPLES;
 	}
 	else {
-		pos.x = pos.x - 0.5 + (k + rand_float()) / JITT_SAMPLES;
-		pos.y = pos.y - 0.5 + (j + rand_float()) / JITT_SAMPLES;
+		pos.x = pos.x - 0.5 + (k + rand_float(sampler)) / JITT_SAMPLES;
+		pos.y = pos.y - 0.5 + (j + rand_float(sampler)) / JITT_SAMPLES;
 	}
 	
 	return pos;
@@ -562,7 +719,7 @@ Vector chooseGridCoords(Vector pos, Light* l = nullptr, int k = 0, int j = 0) {
 
 
 /************************************************* Light Intersection **************************************************/
-Color getLightContribution(Ray ray, Vector intersection_point, Vector normal, Material* mat) {
+Color getLightContribution(Ray ray, Vector intersection_point, Vector normal, Material* mat, Sampler& sampler) {
 	Vector light_direction, reflection;
 	Color light_contribution = Color(0, 0, 0);
 	for (int i = 0; i < scene->getNumLights(); i++) {
@@ -574,23 +731,23 @@ Color getLightContribution(Ray ray, Vector intersection_point, Vector normal, Ma
 			if (!jittering) {
 				for (int k = 0; k < JITT_SAMPLES; k++) {
 					for (int j = 0; j < JITT_SAMPLES; j++) {
-						l_pos = chooseGridCoords(l_pos, l, k, j);
+						l_pos = chooseGridCoords(l_pos, sampler, l, k, j);
 
-						aux += lightReflection(l_pos, intersection_point, normal, ray.direction, mat, l);
+						aux += lightReflection(l_pos, intersection_point, normal, ray.direction, mat, l, ray.time);
 					}
 				}
 				aux = aux / pow(JITT_SAMPLES, 2);
 				light_contribution += aux;
 			}
 			else {
-				l_pos = chooseGridCoords(l_pos, l);
+				l_pos = chooseGridCoords(l_pos, sampler, l);
 
-				light_contribution += lightReflection(l_pos, intersection_point, normal, ray.direction, mat, l);
+				light_contribution += lightReflection(l_pos, intersection_point, normal, ray.direction, mat, l, ray.time);
 			}
 			
 		}
 		else {
-			light_contribution += lightReflection(l_pos, intersection_point, normal, ray.direction, mat, l);
+			light_contribution += lightReflection(l_pos, intersection_point, normal, ray.direction, mat, l, ray.time);
 		}
 	}
 	return light_contribution;
@@ -607,39 +764,62 @@ float schlickApproximation(float cos_i, float n_i, float n_t) {
 /**********************************************************************************************************************/
 /*                                                RAY TRACING                                                         */
 /**********************************************************************************************************************/
-Color rayTracing(Ray ray, int depth, float ior_1)  //index of refraction of medium 1 where the ray is travelling
+Color shadeHit(Ray& ray, Object* hit, HitRecord& rec, int depth, float ior_1, Sampler& sampler);
+
+Color rayTracing(Ray ray, int depth, float ior_1, Sampler& sampler)  //index of refraction of medium 1 where the ray is travelling
 {
-	bool inside = false;
-	float minDist;
+	HitRecord rec;
 	Object* hit = NULL;
-	Vector phit, nhit, L, reflection;
-	Color color = Color(0, 0, 0);
 	bool is_hit = false;
 
     /***************************/
 	/*    Colision Checking    */
 	/***************************/
 
+	//Unbounded objects first: their closest hit clamps the traversal of the acceleration structure
+	is_hit = intersectUnbounded(ray, &hit, rec);
+
 	//If grid is active
 	if (grid_ptr != NULL) {
-		is_hit = grid_ptr->Traverse(ray, &hit, phit);
+		is_hit |= grid_ptr->Traverse(ray, &hit, rec);
+	}
+	//If two-level grid is active
+	else if (hgrid_ptr != NULL) {
+		is_hit |= hgrid_ptr->Traverse(ray, &hit, rec);
 	}
 	//If bvh is active
 	else if (bvh_ptr != NULL) {
-		is_hit = bvh_ptr->Traverse(ray, &hit, phit);
+		is_hit |= bvh_ptr->Traverse(ray, &hit, rec, bvhStack());
+	}
+	//If wide bvh is active
+	else if (wbvh_ptr != NULL) {
+		is_hit |= wbvh_ptr->Traverse(ray, &hit, rec, wbvhStack());
+	}
+	//If motion bvh is active
+	else if (mbvh_ptr != NULL) {
+		is_hit |= mbvh_ptr->Traverse(ray, &hit, rec, mbvhStack());
 	}
 	else {
-		hit = closestObject(ray, minDist);
-		if (hit != NULL) {
-			//Intersection Point
-			phit = ray.origin + ray.direction * minDist;
-		}
+		hit = closestObject(ray, rec);
 	}
 	
 	//If ray intercepts no object return background color
 	if (!is_hit && hit == NULL) return scene->GetSkyboxColor(ray);//return scene->GetBackgroundColor();
 
-	nhit = hit->getNormal(phit);
+	return shadeHit(ray, hit, rec, depth, ior_1, sampler);
+}
+
+// Color of a ray whose closest hit is already known, e.g. from a packet traversal
+Color shadeHit(Ray& ray, Object* hit, HitRecord& rec, int depth, float ior_1, Sampler& sampler)
+{
+	bool inside = false;
+	Vector phit, nhit, L, reflection;
+	Color color = Color(0, 0, 0);
+	Material* mat = hit->GetMaterial(rec);
+
+	//Intersection point and normal
+	phit = ray.origin + ray.direction * rec.t;
+	nhit = rec.normal;
 
 	//If angle between normal and ray direction is above 90 degrees we are inside the object
 	if (ray.direction * nhit > 0) {
@@ -651,42 +831,42 @@ Color rayTracing(Ray ray, int depth, float ior_1)  //index of refraction of medi
 	Vector offset_phit = phit + nhit * BIAS;
 
 	//Get color due to illumination from lights
-	color += getLightContribution(ray, phit, nhit, hit->GetMaterial());
+	color += getLightContribution(ray, phit, nhit, mat, sampler);
 
 
 	//Reflection and refraction contribution
 	float Kr = 1.0f;
-	if (hit->GetMaterial()->GetTransmittance() != 0 && depth < MAX_DEPTH) {
+	if (mat->GetTransmittance() != 0 && depth < MAX_DEPTH) {
 		float cos_d = - (nhit * ray.direction);
-		float n = (inside) ? (hit->GetMaterial()->GetRefrIndex() / ior_1) : (ior_1 / hit->GetMaterial()->GetRefrIndex());
+		float n = (inside) ? (mat->GetRefrIndex() / ior_1) : (ior_1 / mat->GetRefrIndex());
 		float sin_refr2 = n * n * (1 - cos_d * cos_d);
 
-		Kr = (inside) ? schlickApproximation(cos_d, hit->GetMaterial()->GetRefrIndex(), ior_1) : schlickApproximation(cos_d, ior_1, hit->GetMaterial()->GetRefrIndex());
+		Kr = (inside) ? schlickApproximation(cos_d, mat->GetRefrIndex(), ior_1) : schlickApproximation(cos_d, ior_1, mat->GetRefrIndex());
 
 		if (sin_refr2 <= 1) {
 			float cos_refr = sqrt(1 - sin_refr2);
 			Vector refraction = ray.direction * n + nhit * (n * cos_d - cos_refr);
-			Ray refr_ray = Ray(phit - nhit * BIAS, refraction);
-			color += rayTracing(refr_ray, depth + 1, ior_1) * hit->GetMaterial()->GetTransmittance() * (1 - Kr);
+			Ray refr_ray = Ray(phit - nhit * BIAS, refraction, ray.time);
+			color += rayTracing(refr_ray, depth + 1, ior_1, sampler) * mat->GetTransmittance() * (1 - Kr);
 		}
 		else {
 			reflection = ray.direction - nhit * (ray.direction * nhit) * 2;
-			Ray reflRay = Ray(offset_phit, reflection.normalize());
-			color += rayTracing(reflRay, depth + 1, ior_1) * hit->GetMaterial()->GetReflection() * Kr;
+			Ray reflRay = Ray(offset_phit, reflection.normalize(), ray.time);
+			color += rayTracing(reflRay, depth + 1, ior_1, sampler) * mat->GetReflection() * Kr;
 		}
 	}
 
 	
-	if (hit->GetMaterial()->GetReflection() > 0 && depth < MAX_DEPTH) {
+	if (mat->GetReflection() > 0 && depth < MAX_DEPTH) {
 		reflection = ray.direction - nhit * (ray.direction * nhit) * 2;
 		if (fuzzy) {
 			Vector sphere_center = offset_phit + reflection;
-			Vector sphere_offset = sphere_center + rnd_unit_sphere() * 0.3f;
+			Vector sphere_offset = sphere_center + rnd_unit_sphere(sampler) * 0.3f;
 			Vector fuzzy_reflection = (sphere_offset - offset_phit).normalize();
 			if (fuzzy_reflection * nhit > 0) reflection = fuzzy_reflection;
 		}
-		Ray reflRay = Ray(offset_phit, reflection.normalize());
-		color += rayTracing(reflRay, depth + 1, ior_1) * hit->GetMaterial()->GetReflection() * Kr * hit->GetMaterial()->GetSpecColor();
+		Ray reflRay = Ray(offset_phit, reflection.normalize(), ray.time);
+		color += rayTracing(reflRay, depth + 1, ior_1, sampler) * mat->GetReflection() * Kr * mat->GetSpecColor();
 	}
 
 	return color;
@@ -722,121 +902,267 @@ float lerp(float a, float b, float c) {
 	return a + c * (b - a);
 }
 
-void renderScene()
-{
-	int index_pos = 0;
-	int index_col = 0;
-	unsigned int counter = 0;
+/********************************************* Primary Ray Packets ***************************************************/
+#define PACKET_BLOCK 4  // side of the pixel block traced as one packet in the default mode
 
-	if (drawModeEnabled) {
-		glClear(GL_COLOR_BUFFER_BIT);
-		scene->GetCamera()->SetEye(Vector(camX, camY, camZ));  //Camera motion
+// Primary rays are traced as packets when the accelerator is the BVH, the only one with a packet traversal, and
+// without motion blur, as the packet lanes carry no ray time. The lens rays of DOF start at different points of
+// the lens; TraversePacket bounds their origins.
+bool usePrimaryPackets() {
+	return Accel_Struct == BVH_ACC && !progressive && !motion_blur;
+}
+
+// Finds the closest hits of n_rays primary rays in packets of RAY_PACKET_SIZE, then shades every ray on its own.
+// samplers[i] continues the sample of rays[i].
+void tracePrimaryRays(Ray* rays, Sampler* samplers, Color* colors, int n_rays) {
+	Object* hit_obj[RAY_PACKET_SIZE];
+	HitRecord hit_rec[RAY_PACKET_SIZE];
+
+	for (int first = 0; first < n_rays; first += RAY_PACKET_SIZE) {
+		int n = MIN(RAY_PACKET_SIZE, n_rays - first);
+		RayPacket packet;
+
+		for (int i = 0; i < n; i++) {
+			hit_obj[i] = NULL;
+			intersectUnbounded(rays[first + i], &hit_obj[i], hit_rec[i]);
+			packet.setRay(i, rays[first + i]);
+		}
+		bvh_ptr->TraversePacket(packet, hit_obj, hit_rec, bvhStack());
+
+		for (int i = 0; i < n; i++) {
+			if (hit_obj[i] == NULL)
+				colors[first + i] = scene->GetSkyboxColor(rays[first + i]);
+			else
+				colors[first + i] = shadeHit(rays[first + i], hit_obj[i], hit_rec[i], 1, 1.0, samplers[first + i]);
+		}
 	}
-	set_rand_seed(time(NULL));
+}
+/***********************************************************************************************************************/
 
-	for (int y = 0; y < RES_Y; y++)
-	{
-		for (int x = 0; x < RES_X; x++)
-		{
-			/*************************************************************************************/
-			/*                                   RAY CREATION                                    */
-			/*************************************************************************************/
+/*************************************************** Pixel Color *****************************************************/
+Color renderPixel(int x, int y)
+{
+	Color color = Color(0, 0, 0);
+	Vector pixel;  //viewport coordinates
+	Sampler sampler(y * RES_X + x, 0, frame_index);
 
-			Color color = Color(0, 0, 0);
-			Vector pixel;  //viewport coordinates
+	pixel.x = x + 0.5f;
+	pixel.y = y + 0.5f;
 
-			pixel.x = x + 0.5f;
-			pixel.y = y + 0.5f;
+	/*******************
+	* Progressive Mode *
+	*******************/
+	if (progressive) {
+		pixel.x = x - 0.5f + rand_float(sampler);
+		pixel.y = y - 0.5f + rand_float(sampler);
 
-			/*******************
-			* Progressive Mode *
-			*******************/
-			if (progressive) {
-				pixel.x = x - 0.5f + rand_float();
-				pixel.y = y - 0.5f + rand_float();
+		Ray ray = scene->GetCamera()->PrimaryRay(pixel);
 
-				Ray ray = scene->GetCamera()->PrimaryRay(pixel);
+		color += rayTracing(ray, 1, 1.0, sampler).clamp();
+	}
+	/*******************
+	*  Jittering Mode  *
+	*******************/
+	else if (jittering && usePrimaryPackets()) {  //the samples of the pixel are traced together
+		Ray rays[JITT_SAMPLES * JITT_SAMPLES];
+		Sampler samplers[JITT_SAMPLES * JITT_SAMPLES];
+		Color colors[JITT_SAMPLES * JITT_SAMPLES];
+
+		for (int i = 0; i < JITT_SAMPLES; i++) {
+			for (int j = 0; j < JITT_SAMPLES; j++) {
+				sampler.SetSample(i * JITT_SAMPLES + j);
+				pixel = chooseGridCoords(pixel, sampler, nullptr, i, j);
 
-				color += rayTracing(ray, 1, 1.0).clamp();
-			}
-			/*******************
-			*  Jittering Mode  *
-			*******************/
-			else if(jittering){
-				Ray ray = Ray(Vector(0,0,0), Vector(0, 0, 0));
-				for (int i = 0; i < JITT_SAMPLES; i++) {
-					for (int j = 0; j < JITT_SAMPLES; j++) {
-						pixel = chooseGridCoords(pixel, nullptr, i, j);
-
-						if (dof) {
-							Vector lens_sample = rnd_unit_disk() * scene->GetCamera()->GetAperture();
-							ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
-						}
-						else if (motion_blur) {
-							ray = scene->GetCamera()->PrimaryRay(pixel, rand_float());
-						}
-						else {
-							ray = scene->GetCamera()->PrimaryRay(pixel);
-						}
-
-						color += rayTracing(ray, 1, 1.0).clamp();
-					}
+				if (dof) {
+					Vector lens_sample = rnd_unit_disk(sampler) * scene->GetCamera()->GetAperture();
+					rays[i * JITT_SAMPLES + j] = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
 				}
-
-				color = color / pow(JITT_SAMPLES, 2);
+				else {
+					rays[i * JITT_SAMPLES + j] = scene->GetCamera()->PrimaryRay(pixel);
+				}
+				samplers[i * JITT_SAMPLES + j] = sampler;
 			}
-			/*******************
-			*   Default Mode   *
-			*******************/
-			else {
-				Ray ray = Ray(Vector(0, 0, 0), Vector(0, 0, 0));
+		}
+		tracePrimaryRays(rays, samplers, colors, JITT_SAMPLES * JITT_SAMPLES);
+
+		for (int s = 0; s < JITT_SAMPLES * JITT_SAMPLES; s++)
+			color += colors[s].clamp();
+
+		color = color / pow(JITT_SAMPLES, 2);
+	}
+	else if(jittering){
+		Ray ray = Ray(Vector(0,0,0), Vector(0, 0, 0));
+		for (int i = 0; i < JITT_SAMPLES; i++) {
+			for (int j = 0; j < JITT_SAMPLES; j++) {
+				sampler.SetSample(i * JITT_SAMPLES + j);
+				pixel = chooseGridCoords(pixel, sampler, nullptr, i, j);
+
 				if (dof) {
-					for (int k = 0; k < LENS_SAMPLES; k++) {
-						Vector lens_sample = rnd_unit_disk() * scene->GetCamera()->GetAperture();
-						ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
-					}
+					Vector lens_sample = rnd_unit_disk(sampler) * scene->GetCamera()->GetAperture();
+					ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
+				}
+				else if (motion_blur) {
+					ray = scene->GetCamera()->PrimaryRay(pixel, rand_float(sampler));
 				}
 				else {
 					ray = scene->GetCamera()->PrimaryRay(pixel);
 				}
-				color = rayTracing(ray, 1, 1.0).clamp();
+
+				color += rayTracing(ray, 1, 1.0, sampler).clamp();
 			}
-			/*************************************************************************************/
-		
-			img_Data[counter++] = u8fromfloat((float)color.r());
-			img_Data[counter++] = u8fromfloat((float)color.g());
-			img_Data[counter++] = u8fromfloat((float)color.b());
-			
-			
-			
-			if (drawModeEnabled) {
-				vertices[index_pos++] = (float)x;
-				vertices[index_pos++] = (float)y;
-				if (progressive) {
-					if (FrameCount == 0) {
-						colors[index_col++] = (float)color.r();
-						colors[index_col++] = (float)color.g();
-						colors[index_col++] = (float)color.b();
-					}
-					else {
-						colors[index_col] = lerp(colors[index_col], (float)color.r(), 1.0f/FrameCount);
-						index_col++;
-						colors[index_col] = lerp(colors[index_col], (float)color.g(), 1.0f/FrameCount);
-						index_col++;
-						colors[index_col] = lerp(colors[index_col], (float)color.b(), 1.0f/FrameCount);
-						index_col++;
-					}
-				}
-				else {
-					colors[index_col++] = (float)color.r();
-					colors[index_col++] = (float)color.g();
+		}
+
+		color = color / pow(JITT_SAMPLES, 2);
+	}
+	/*******************
+	*   Default Mode   *
+	*******************/
+	else {
+		Ray ray = Ray(Vector(0, 0, 0), Vector(0, 0, 0));
+		if (dof) {
+			for (int k = 0; k < LENS_SAMPLES; k++) {
+				sampler.SetSample(k);
+				Vector lens_sample = rnd_unit_disk(sampler) * scene->GetCamera()->GetAperture();
+				ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
+			}
+		}
+		else {
+			ray = scene->GetCamera()->PrimaryRay(pixel);
+		}
+		color = rayTracing(ray, 1, 1.0, sampler).clamp();
+	}
+	return color;
+}
+/***********************************************************************************************************************/
+
+/*************************************************** Tile Rendering ****************************************************/
+// Stores the color of a pixel in img_Data and, in the drawing mode, in vertices and colors
+void storePixel(int x, int y, Color color)
+{
+	int pixel_index = y * RES_X + x;
+	int counter = 3 * pixel_index;
+
+	img_Data[counter++] = u8fromfloat((float)color.r());
+	img_Data[counter++] = u8fromfloat((float)color.g());
+	img_Data[counter++] = u8fromfloat((float)color.b());
+
+	if (drawModeEnabled) {
+		int index_pos = 2 * pixel_index;
+		int index_col = 3 * pixel_index;
+
+		vertices[index_pos++] = (float)x;
+		vertices[index_pos++] = (float)y;
+		if (progressive) {
+			if (FrameCount == 0) {
+				colors[index_col++] = (float)color.r();
+				colors[index_col++] = (float)color.g();
+				colors[index_col++] = (float)color.b();
+			}
+			else {
+				colors[index_col] = lerp(colors[index_col], (float)color.r(), 1.0f/FrameCount);
+				index_col++;
+				colors[index_col] = lerp(colors[index_col], (float)color.g(), 1.0f/FrameCount);
+				index_col++;
+				colors[index_col] = lerp(colors[index_col], (float)color.b(), 1.0f/FrameCount);
+				index_col++;
+			}
+		}
+		else {
+			colors[index_col++] = (float)color.r();
+			colors[index_col++] = (float)color.g();
+
+			colors[index_col++] = (float)color.b();
+		}
+	}
+}
 
-					colors[index_col++] = (float)color.b();
+// Default mode with packets: one ray through the centre of each pixel of a block, traced together
+void renderBlock(int x0, int y0, int x1, int y1)
+{
+	Ray rays[PACKET_BLOCK * PACKET_BLOCK];
+	Sampler samplers[PACKET_BLOCK * PACKET_BLOCK];
+	Color colors[PACKET_BLOCK * PACKET_BLOCK];
+	int n = 0;
+
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			Vector pixel;
+			Sampler sampler(y * RES_X + x, 0, frame_index);
+			pixel.x = x + 0.5f;
+			pixel.y = y + 0.5f;
+
+			//same rays and sampler state as renderPixel
+			if (dof) {
+				for (int k = 0; k < LENS_SAMPLES; k++) {
+					sampler.SetSample(k);
+					Vector lens_sample = rnd_unit_disk(sampler) * scene->GetCamera()->GetAperture();
+					rays[n] = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
 				}
 			}
+			else {
+				rays[n] = scene->GetCamera()->PrimaryRay(pixel);
+			}
+			samplers[n++] = sampler;
 		}
+	}
+	tracePrimaryRays(rays, samplers, colors, n);
+
+	n = 0;
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++)
+			storePixel(x, y, colors[n++].clamp());
+}
+
+// Each tile writes only its own pixels of img_Data, vertices and colors, so tiles can run concurrently
+void renderTile(int x0, int y0, int x1, int y1)
+{
+	if (!jittering && usePrimaryPackets()) {
+		for (int y = y0; y < y1; y += PACKET_BLOCK)
+			for (int x = x0; x < x1; x += PACKET_BLOCK)
+				renderBlock(x, y, min(x + PACKET_BLOCK, x1), min(y + PACKET_BLOCK, y1));
+		return;
+	}
 
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			storePixel(x, y, renderPixel(x, y));
+		}
+	}
+}
+/***********************************************************************************************************************/
+
+void renderScene()
+{
+	if (drawModeEnabled) {
+		glClear(GL_COLOR_BUFFER_BIT);
+		scene->GetCamera()->SetEye(Vector(camX, camY, camZ));  //Camera motion
+	}
+	frame_index++;  //new random sequence for every frame
+
+	//the BVH is refitted to the moved objects, the other accelerators are built again
+	if (animation && scene->hasAnimations()) {
+		scene->Animate(frame_index);
+		if (Accel_Struct == BVH_ACC)
+			bvh_ptr->Update(pool_ptr);
+		else if (Accel_Struct != NONE)
+			buildAccelerator();
 	}
+
+	/* The frame is split in TILE_SIZE x TILE_SIZE tiles. Tiles are seeded in scanline order on the
+	   workers' deques and idle workers steal from the others, so expensive regions are shared out. */
+	int tiles_x = (RES_X + TILE_SIZE - 1) / TILE_SIZE;
+	int tiles_y = (RES_Y + TILE_SIZE - 1) / TILE_SIZE;
+
+	pool_ptr->ParallelFor(0, tiles_x * tiles_y, 1, [=](int first, int last) {
+		for (int t = first; t < last; t++) {
+			int x0 = (t % tiles_x) * TILE_SIZE;
+			int y0 = (t / tiles_x) * TILE_SIZE;
+			renderTile(x0, y0, min(x0 + TILE_SIZE, RES_X), min(y0 + TILE_SIZE, RES_Y));
+		}
+	});
+
 	if (drawModeEnabled) {
 		drawPoints();
 		glutSwapBuffers();
@@ -929,32 +1255,12 @@ void init_scene(void)
 	img_Data = (uint8_t*)malloc(3 * RES_X * RES_Y * sizeof(uint8_t));
 	if (img_Data == NULL) exit(1);
 
-	Accel_Struct = scene->GetAccelStruct();   //Type of acceleration data structure
-
-	if (Accel_Struct == GRID_ACC) {
-		grid_ptr = new Grid();
-		vector<Object*> objs;
-		int num_objects = scene->getNumObjects();
+	//bottom-level BVHs of the instanced groups, traversed by the instances whatever the scene accelerator
+	for (int i = 0; i < scene->getNumGroups(); i++)
+		scene->getGroup(i)->Build(pool_ptr);
 
-		for (int o = 0; o < num_objects; o++) {
-			objs.push_back(scene->getObject(o));
-		}
-		grid_ptr->Build(objs);
-		printf("Grid built.\n\n");
-	}
-	else if (Accel_Struct == BVH_ACC) {
-		vector<Object*> objs;
-		int num_objects = scene->getNumObjects();
-		bvh_ptr = new BVH();
-
-		for (int o = 0; o < num_objects; o++) {
-			objs.push_back(scene->getObject(o));
-		}
-		bvh_ptr->Build(objs);
-		printf("BVH built.\n\n");
-	}
-	else
-		printf("No acceleration data structure.\n\n");
+	Accel_Struct = scene->GetAccelStruct();   //Type of acceleration data structure
+	buildAccelerator();
 
 	unsigned int spp = scene->GetSamplesPerPixel();
 	if (spp == 0)
@@ -974,6 +1280,13 @@ int main(int argc, char* argv[])
 	}
 	ilInit();
 
+	for (int i = 1; i + 1 < argc; i++)
+		if (strcmp(argv[i], "-threads") == 0)
+			n_threads = (unsigned int)atoi(argv[++i]);
+
+	pool_ptr = new ThreadPool(n_threads);
+	printf("Rendering with %d threads.\n\n", pool_ptr->getNumThreads());
+
 	int
 		ch;
 	if (!drawModeEnabled) {
@@ -981,11 +1294,17 @@ int main(int argc, char* argv[])
 		do {
 			init_scene();
 
+			Grid::ResetStats();
 			auto timeStart = std::chrono::high_resolution_clock::now();
 			renderScene();  //Just creating an image file
 			auto timeEnd = std::chrono::high_resolution_clock::now();
 			auto passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
 			printf("\nDone: %.2f (sec)\n", passedTime / 1000);
+			if (Accel_Struct == GRID_ACC || Accel_Struct == HGRID_ACC) {
+				unsigned long long tests, saved;
+				Grid::GetStats(tests, saved);
+				printf("Grid: %llu primitive tests, %llu saved by mailboxing (%.1f%%)\n", tests, saved, 100.0 * saved / MAX(tests + saved, 1ULL));
+			}
 			if (!P3F_scene) break;
 			cout << "\nPress 'y' to render another image or another key to terminate!\n";
 			delete(scene);
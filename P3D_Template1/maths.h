@@ -2,10 +2,29 @@
 #define __MATHS__
 
 #include <stdlib.h>
+#include <stdint.h>
 #include "vector.h"
 
 #define PI				3.141592653589793238462f
 
+// Counter-based random number generator: every value is a hash of (pixel, sample index, dimension, frame),
+// so the result does not depend on the thread or the order in which pixels are rendered.
+class Sampler
+{
+public:
+	Sampler(void) : pixel(0), sample(0), frame(0), dimension(0) {};
+	Sampler(uint32_t pixel_, uint32_t sample_, uint32_t frame_) :
+		pixel(pixel_), sample(sample_), frame(frame_), dimension(0) {};
+
+	void SetSample(uint32_t sample_) { sample = sample_; dimension = 0; }
+	uint32_t GetSample() { return sample; }
+	float Get1D();   // next dimension of the current sample, in [0, 1)
+
+private:
+	uint32_t pixel, sample, frame;
+	uint32_t dimension;
+};
+
 // prototypes
 
 unsigned int float_to_int(double x);
@@ -19,6 +38,10 @@ double rand_double(double min, double max);
 Vector rnd_unit_disk(void);
 Vector rnd_unit_sphere(void);
 void set_rand_seed(const int seed);
+uint32_t pcg4d_hash(uint32_t x, uint32_t y, uint32_t z, uint32_t w);
+float rand_float(Sampler& sampler);
+Vector rnd_unit_disk(Sampler& sampler);
+Vector rnd_unit_sphere(Sampler& sampler);
 uint8_t u8fromfloat(float x);
 float u8tofloat(uint8_t x);
 
@@ -109,6 +132,62 @@ set_rand_seed(const int seed) {
 	srand(seed);
 }
 
+// ---------------------------------------------------- pcg4d_hash
+// 4D PCG hash (Jarzynski and Olano, "Hash Functions for GPU Rendering")
+
+inline uint32_t
+pcg4d_hash(uint32_t x, uint32_t y, uint32_t z, uint32_t w) {
+	x = x * 1664525u + 1013904223u;
+	y = y * 1664525u + 1013904223u;
+	z = z * 1664525u + 1013904223u;
+	w = w * 1664525u + 1013904223u;
+
+	x += y * w; y += z * x; z += x * y; w += y * z;
+	x ^= x >> 16; y ^= y >> 16; z ^= z >> 16; w ^= w >> 16;
+	x += y * w; y += z * x; z += x * y; w += y * z;
+	return x;
+}
+
+// ---------------------------------------------------- Sampler::Get1D
+
+inline float
+Sampler::Get1D(void) {
+	uint32_t bits = pcg4d_hash(pixel, sample, dimension++, frame);
+	return (float)(bits >> 8) * (1.0f / 16777216.0f);  //24 bits of mantissa
+}
+
+// ---------------------------------------------------- rand_float(sampler)
+
+inline float
+rand_float(Sampler& sampler) {
+	return sampler.Get1D();
+}
+
+// ---------------------------------------------------- rnd_unit_disk(sampler)
+
+inline Vector rnd_unit_disk(Sampler& sampler) {
+	Vector p;
+	do {
+		float x = rand_float(sampler);
+		float y = rand_float(sampler);
+		p = Vector(x, y, 0.0) * 2 - Vector(1.0, 1.0, 0.0);
+	} while (p * p >= 1.0);
+	return p;
+}
+
+// ---------------------------------------------------- rnd_unit_sphere(sampler)
+
+inline Vector rnd_unit_sphere(Sampler& sampler) {
+	Vector p;
+	do {
+		float x = rand_float(sampler);
+		float y = rand_float(sampler);
+		float z = rand_float(sampler);
+		p = Vector(x, y, z) * 2 - Vector(1.0, 1.0, 1.0);
+	} while (p * p >= 1.0);
+	return p;
+}
+
 // ---------------------------------------------------- float to byte (unsigned char)
 inline uint8_t u8fromfloat(float x)
 {
@@ -0,0 +1,209 @@
+#include <malloc.h>
+#include <string.h>
+#include <algorithm>
+#include "rayAccelerator.h"
+#include "macros.h"
+
+using namespace std;
+
+void MotionBVH::MotionNode::setAABB(AABB& bbox0, AABB& bbox1) {
+	bmin[0] = bbox0.min.x; bmin[1] = bbox0.min.y; bmin[2] = bbox0.min.z;
+	bmax[0] = bbox0.max.x; bmax[1] = bbox0.max.y; bmax[2] = bbox0.max.z;
+	dmin[0] = bbox1.min.x - bmin[0]; dmin[1] = bbox1.min.y - bmin[1]; dmin[2] = bbox1.min.z - bmin[2];
+	dmax[0] = bbox1.max.x - bmax[0]; dmax[1] = bbox1.max.y - bmax[1]; dmax[2] = bbox1.max.z - bmax[2];
+}
+
+bool MotionBVH::MotionNode::intercepts(const Vector& origin, const Vector& inv_dir, float time, float& t) const {
+	float tx_min = (bmin[0] + dmin[0] * time - origin.x) * inv_dir.x, tx_max = (bmax[0] + dmax[0] * time - origin.x) * inv_dir.x;
+	float ty_min = (bmin[1] + dmin[1] * time - origin.y) * inv_dir.y, ty_max = (bmax[1] + dmax[1] * time - origin.y) * inv_dir.y;
+	float tz_min = (bmin[2] + dmin[2] * time - origin.z) * inv_dir.z, tz_max = (bmax[2] + dmax[2] * time - origin.z) * inv_dir.z;
+
+	if (inv_dir.x < 0) swap(tx_min, tx_max);
+	if (inv_dir.y < 0) swap(ty_min, ty_max);
+	if (inv_dir.z < 0) swap(tz_min, tz_max);
+
+	//largest entering t value
+	float t0 = MAX3(tx_min, ty_min, tz_min);
+
+	//smallest exiting t value
+	float t1 = MIN3(tx_max, ty_max, tz_max);
+
+	t = (t0 < 0) ? 0.0f : t0;
+
+	return (t0 < t1 && t1 > 0);
+}
+
+
+MotionBVH::MotionBVH(void) {}
+
+MotionBVH::~MotionBVH(void) {
+	if (nodes != NULL)
+		_aligned_free(nodes);
+}
+
+int MotionBVH::getNumObjects() { return bvh.getNumObjects(); }
+
+/* The binary tree is built over the moving primitives at mid-shutter, then each node gets the bounds of its
+   objects at time 0 and at time 1. The union of moving boxes does not move linearly, but interpolating it is
+   still conservative: the min corner of every primitive box is a linear function of time (they are static or
+   move with a linear motion), and the min over them is concave, so it lies above the line through its values
+   at times 0 and 1, which is the interpolated node min. The same holds for the max corners, which are convex.
+   The interpolated node box thus holds its subtree at any time in [0, 1]. */
+void MotionBVH::Build(vector<Object*>& objs, ThreadPool* pool) {
+	//free the nodes of a previous build
+	if (nodes != NULL)
+		_aligned_free(nodes);
+	nodes = NULL; n_nodes = 0;
+
+	bvh.mid_shutter_bounds = true;
+	bvh.keep_bounds = true;
+	bvh.Build(objs, pool);
+	if (bvh.nodes == NULL)
+		return;
+
+	n_nodes = bvh.n_nodes;
+	nodes = (MotionNode*)_aligned_malloc(n_nodes * sizeof(MotionNode), 64);
+	memset(nodes, 0, n_nodes * sizeof(MotionNode));
+
+	//children follow their parent in depth-first order, so a backward pass visits them first
+	Vector empty_min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), empty_max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	vector<AABB> bbox0(n_nodes), bbox1(n_nodes);
+	int n_moving = 0;
+
+	for (int n = (int)n_nodes - 1; n >= 0; n--) {
+		const BVH::BVHNode& bin_node = bvh.nodes[n];
+		bbox0[n] = AABB(empty_min, empty_max);
+		bbox1[n] = AABB(empty_min, empty_max);
+
+		if (bin_node.isLeaf()) {
+			unsigned int first = bin_node.getIndex();
+			for (unsigned int i = first; i < first + bin_node.getNObjs(); i++) {
+				AABB obj0, obj1;
+				bvh.prims.GetMotionBounds(bvh.objects[i], obj0, obj1);
+				bbox0[n].extend(obj0);
+				bbox1[n].extend(obj1);
+				if (bvh.objects[i].type == PRIM_MOVING_SPHERE)
+					n_moving++;
+			}
+		}
+		else {
+			unsigned int right = bin_node.getIndex();
+			bbox0[n].extend(bbox0[n + 1]); bbox0[n].extend(bbox0[right]);
+			bbox1[n].extend(bbox1[n + 1]); bbox1[n].extend(bbox1[right]);
+		}
+
+		nodes[n].setAABB(bbox0[n], bbox1[n]);
+		nodes[n].setNode(bin_node.getIndex(), bin_node.getNObjs());
+	}
+
+	//only the objects vector and the leaf blocks of the binary tree are still needed
+	_aligned_free(bvh.nodes);
+	bvh.nodes = NULL;
+	bvh.prims.releaseBounds();
+
+	printf("Motion BVH: total nodes = %d, moving objects = %d\n\n", n_nodes, n_moving);
+}
+
+bool MotionBVH::Traverse(Ray& ray, Object** hit_obj, HitRecord& hit_rec, StackItem* stack) const {
+	float tmin = ray.tmax;  //contains the closest primitive intersection
+	float t;
+	bool hit = false;
+	int stack_ptr = 0;
+
+	if (nodes == NULL)
+		return false;
+
+	Vector inv_dir = Vector(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	unsigned int current = 0;  //root node
+	if (!nodes[current].intercepts(ray.origin, inv_dir, ray.time, t))
+		return false;
+
+	//same order as the binary BVH: descend into the nearer child and push the farther one
+	while (true) {
+		const MotionNode& node = nodes[current];
+		if (!node.isLeaf()) {
+			unsigned int left = current + 1, right = node.getIndex();
+			float t_left, t_right;
+			bool left_hit = nodes[left].intercepts(ray.origin, inv_dir, ray.time, t_left);
+			bool right_hit = nodes[right].intercepts(ray.origin, inv_dir, ray.time, t_right);
+
+			if (left_hit && right_hit) {
+				if (t_right > t_left) {
+					stack[stack_ptr++] = StackItem(right, t_right);
+					current = left;
+				}
+				else {
+					stack[stack_ptr++] = StackItem(left, t_left);
+					current = right;
+				}
+				continue;
+			}
+			else if (left_hit || right_hit) {
+				current = left_hit ? left : right;
+				continue;
+			}
+		}
+		else if (bvh.intersect_leaf(node.getIndex(), node.getNObjs(), ray, tmin, hit_obj, hit_rec))
+			hit = true;
+
+		//pop the next subtree entered before the closest hit
+		while (true) {
+			if (stack_ptr == 0)
+				return hit;
+			StackItem si = stack[--stack_ptr];
+			if (si.t < tmin) {
+				current = si.index;
+				break;
+			}
+		}
+	}
+}
+
+// Children entered beyond ray.tmax are never visited.
+bool MotionBVH::Occluded(Ray& ray, StackItem* stack) const {
+	float t;
+	int stack_ptr = 0;
+
+	if (nodes == NULL)
+		return false;
+
+	Vector inv_dir = Vector(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	unsigned int current = 0;  //root node
+	if (!nodes[current].intercepts(ray.origin, inv_dir, ray.time, t) || t > ray.tmax)
+		return false;
+
+	while (true) {
+		const MotionNode& node = nodes[current];
+		if (!node.isLeaf()) {
+			unsigned int left = current + 1, right = node.getIndex();
+			float t_left, t_right;
+			bool left_hit = nodes[left].intercepts(ray.origin, inv_dir, ray.time, t_left) && t_left <= ray.tmax;
+			bool right_hit = nodes[right].intercepts(ray.origin, inv_dir, ray.time, t_right) && t_right <= ray.tmax;
+
+			if (left_hit && right_hit) {
+				//any hit ends the query, but the nearer child is more likely to hold an occluder
+				if (t_right > t_left) {
+					stack[stack_ptr++] = StackItem(right, t_right);
+					current = left;
+				}
+				else {
+					stack[stack_ptr++] = StackItem(left, t_left);
+					current = right;
+				}
+				continue;
+			}
+			else if (left_hit || right_hit) {
+				current = left_hit ? left : right;
+				continue;
+			}
+		}
+		else if (bvh.occluded_leaf(node.getIndex(), node.getNObjs(), ray))
+			return true;
+
+		if (stack_ptr == 0)
+			return false;
+		current = stack[--stack_ptr].index;
+	}
+}
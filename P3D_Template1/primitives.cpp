@@ -0,0 +1,408 @@
+#include <algorithm>
+#include "primitives.h"
+#include "macros.h"
+
+TrianglePrim::TrianglePrim(const Vector& P0_, const Vector& P1, const Vector& P2)
+	: P0(P0_), e1(P1 - P0_), e2(P2 - P0_)
+{}
+
+AABB TrianglePrim::GetBoundingBox() const {
+	Vector P1 = P0 + e1, P2 = P0 + e2;
+
+	Vector Min = Vector(min(P0.x, min(P1.x, P2.x)), min(P0.y, min(P1.y, P2.y)), min(P0.z, min(P1.z, P2.z)));
+	Vector Max = Vector(max(P0.x, max(P1.x, P2.x)), max(P0.y, max(P1.y, P2.y)), max(P0.z, max(P1.z, P2.z)));
+
+	// enlarge the bounding box a bit just in case...
+	Min -= EPSILON;
+	Max += EPSILON;
+	return(AABB(Min, Max));
+}
+
+Vector TrianglePrim::getNormal() const {
+	Vector normal = e1 % e2;
+	normal.normalize();
+	return normal;
+}
+
+bool TrianglePrim::intercepts(const Ray& r, float& t, float& u, float& v) const {
+	Vector pvec = r.direction % e2;
+	float det = e1 * pvec;  //the denominator shared by u, v and t
+	if (det == 0.0f) return false;  //ray parallel to the triangle
+	float inv_det = 1.0f / det;
+
+	Vector tvec = r.origin - P0;
+	u = (tvec * pvec) * inv_det;
+	if (u < 0 || u > 1) return false;
+
+	Vector qvec = tvec % e1;
+	v = (r.direction * qvec) * inv_det;
+	if (v < 0 || u + v > 1) return false;
+
+	t = (e2 * qvec) * inv_det;
+	if (t < 0) return false;
+	return (true);
+}
+
+bool TrianglePrim::intercepts(const Ray& r, HitRecord& rec) const {
+	if (!intercepts(r, rec.t, rec.u, rec.v))
+		return false;
+	rec.prim_id = 0;
+	rec.normal = getNormal();
+	return true;
+}
+
+
+TrianglePrim QuantizedTrianglePrim::decode() const {
+	const unsigned int* v = &mesh->indices[3 * face];
+	return TrianglePrim(mesh->getVertex(v[0]), mesh->getVertex(v[1]), mesh->getVertex(v[2]));
+}
+
+
+AABB SpherePrim::GetBoundingBox() const {
+	Vector a_min(center.x - radius, center.y - radius, center.z - radius);
+	Vector a_max(center.x + radius, center.y + radius, center.z + radius);
+	return(AABB(a_min, a_max));
+}
+
+bool SpherePrim::intercepts(const Ray& r, float& t) const {
+	Vector oc = center - r.origin;
+	float b = r.direction * oc;
+	float c = oc * oc - SqRadius;
+	float disc = b * b - c;
+
+	if (disc <= 0.0f) return false;
+
+	if (c > 0.0f) {  //origin outside the sphere
+		if (b <= 0.0f) return false;
+		t = b - sqrt(disc);
+	}
+	else t = b + sqrt(disc);
+
+	return true;
+}
+
+bool SpherePrim::intercepts(const Ray& r, HitRecord& rec) const {
+	if (!intercepts(r, rec.t))
+		return false;
+	rec.prim_id = 0;
+	rec.normal = getNormal(r, rec.t);
+	rec.u = rec.v = 0.0f;
+	return true;
+}
+
+
+Vector MovingSpherePrim::centerAt(float time) const {
+	return center_0 + (center_1 - center_0) * ((time - time0) / (time1 - time0));
+}
+
+AABB MovingSpherePrim::GetBoundingBox() const {
+	AABB bbox = GetBoundingBox(0.0f);
+	bbox.extend(GetBoundingBox(1.0f));
+	return bbox;
+}
+
+bool MovingSpherePrim::intercepts(const Ray& r, float& t) const {
+	return SpherePrim(centerAt(r.time), radius).intercepts(r, t);
+}
+
+bool MovingSpherePrim::intercepts(const Ray& r, HitRecord& rec) const {
+	if (!intercepts(r, rec.t))
+		return false;
+	rec.prim_id = 0;
+	rec.normal = (r.origin + r.direction * rec.t - centerAt(r.time)).normalize();
+	rec.u = rec.v = 0.0f;
+	return true;
+}
+
+
+bool BoxPrim::intercepts(const Ray& r, float& t) const {
+	HitRecord rec;
+
+	if (!intercepts(r, rec))
+		return false;
+	t = rec.t;
+	return true;
+}
+
+bool BoxPrim::intercepts(const Ray& ray, HitRecord& rec) const {
+	double tx_min, ty_min, tz_min;
+	double tx_max, ty_max, tz_max;
+
+	double a = 1.0 / ray.direction.x;
+	if (a >= 0) {
+		tx_min = (this->min.x - ray.origin.x) * a;
+		tx_max = (this->max.x - ray.origin.x) * a;
+	}
+	else {
+		tx_min = (this->max.x - ray.origin.x) * a;
+		tx_max = (this->min.x - ray.origin.x) * a;
+	}
+
+	double b = 1.0 / ray.direction.y;
+	if (b >= 0) {
+		ty_min = (this->min.y - ray.origin.y) * b;
+		ty_max = (this->max.y - ray.origin.y) * b;
+	}
+	else {
+		ty_min = (this->max.y - ray.origin.y) * b;
+		ty_max = (this->min.y - ray.origin.y) * b;
+	}
+
+	double c = 1.0 / ray.direction.z;
+	if (c >= 0) {
+		tz_min = (this->min.z - ray.origin.z) * c;
+		tz_max = (this->max.z - ray.origin.z) * c;
+	}
+	else {
+		tz_min = (this->max.z - ray.origin.z) * c;
+		tz_max = (this->min.z - ray.origin.z) * c;
+	}
+
+	float tE, tL;
+	Vector face_in, face_out;
+	if (tx_min > ty_min) {
+		tE = tx_min;
+		face_in = (a >= 0.0) ? Vector(-1, 0, 0) : Vector(1, 0, 0);
+	}
+	else {
+		tE = ty_min;
+		face_in = (b >= 0.0) ? Vector(0, -1, 0) : Vector(0, 1, 0);
+	}
+	if (tz_min > tE) {
+		tE = tz_min;
+		face_in = (c >= 0.0) ? Vector(0, 0, -1) : Vector(0, 0, 1);
+	}
+
+	if (tx_max < ty_max) {
+		tL = tx_max;
+		face_out = (a >= 0.0) ? Vector(1, 0, 0) : Vector(-1, 0, 0);
+	}
+	else {
+		tL = ty_max;
+		face_out = (b >= 0.0) ? Vector(0, 1, 0) : Vector(0, -1, 0);
+	}
+	if (tz_max < tL) {
+		tL = tz_max;
+		face_out = (c >= 0.0) ? Vector(0, 0, 1) : Vector(0, 0, -1);
+	}
+
+	if (tE < tL && tL > 0) {
+		if (tE > 0) {
+			rec.t = tE;
+			rec.normal = face_in;
+		}
+		else {
+			rec.t = tL;
+			rec.normal = face_out;
+		}
+		rec.prim_id = 0;
+		rec.u = rec.v = 0.0f;
+		return true;
+	}
+
+	return false;
+}
+
+
+void PrimitiveStore::Compile(vector<Object*>& objs, bool mid_shutter) {
+	for (Object* obj : objs)
+		obj->Compile(*this);
+	computeBounds(mid_shutter);
+}
+
+void PrimitiveStore::add(const TrianglePrim& tri, Object* obj, unsigned int prim) {
+	triangles.push_back(tri);
+	owners[PRIM_TRIANGLE].push_back(PrimOwner{ obj, prim });
+}
+
+void PrimitiveStore::add(const SpherePrim& sphere, Object* obj) {
+	spheres.push_back(sphere);
+	owners[PRIM_SPHERE].push_back(PrimOwner{ obj, 0 });
+}
+
+void PrimitiveStore::add(const MovingSpherePrim& sphere, Object* obj) {
+	moving_spheres.push_back(sphere);
+	owners[PRIM_MOVING_SPHERE].push_back(PrimOwner{ obj, 0 });
+}
+
+void PrimitiveStore::add(const BoxPrim& box, Object* obj) {
+	boxes.push_back(box);
+	owners[PRIM_BOX].push_back(PrimOwner{ obj, 0 });
+}
+
+void PrimitiveStore::add(const QuantizedTrianglePrim& tri, Object* obj, unsigned int prim) {
+	quantized_triangles.push_back(tri);
+	owners[PRIM_QUANTIZED_TRIANGLE].push_back(PrimOwner{ obj, prim });
+}
+
+void PrimitiveStore::Clear() {
+	triangles.clear();
+	spheres.clear();
+	moving_spheres.clear();
+	boxes.clear();
+	quantized_triangles.clear();
+	for (int type = 0; type < PRIM_TYPES; type++)
+		owners[type].clear();
+}
+
+void PrimitiveStore::addObject(Object* obj, unsigned int prim) {
+	owners[PRIM_OBJECT].push_back(PrimOwner{ obj, prim });
+}
+
+unsigned int PrimitiveStore::size() const {
+	unsigned int n = 0;
+	for (int type = 0; type < PRIM_TYPES; type++)
+		n += owners[type].size();
+	return n;
+}
+
+void PrimitiveStore::getRefs(vector<PrimRef>& refs) const {
+	refs.reserve(refs.size() + size());
+	for (int type = 0; type < PRIM_TYPES; type++) {
+		for (unsigned int i = 0; i < owners[type].size(); i++)
+			refs.push_back(PrimRef(type, i));
+	}
+}
+
+void PrimitiveStore::computeBounds(bool mid_shutter) {
+	unsigned int n = 0;
+	for (int type = 0; type < PRIM_TYPES; type++) {
+		first_id[type] = n;
+		n += owners[type].size();
+	}
+
+	bounds.resize(n);
+	centroids.resize(n);
+	for (int type = 0; type < PRIM_TYPES; type++) {
+		for (unsigned int i = 0; i < owners[type].size(); i++) {
+			PrimRef ref(type, i);
+			unsigned int id = getId(ref);
+			if (mid_shutter && type == PRIM_MOVING_SPHERE)
+				bounds[id] = moving_spheres[i].GetBoundingBox(0.5f);
+			else
+				bounds[id] = GetBoundingBox(ref);
+			centroids[id] = bounds[id].centroid();
+		}
+	}
+}
+
+void PrimitiveStore::releaseBounds() {
+	vector<AABB>().swap(bounds);
+	vector<Vector>().swap(centroids);
+}
+
+AABB PrimitiveStore::GetBoundingBox(const PrimRef& ref) const {
+	switch (ref.type) {
+	case PRIM_TRIANGLE: return triangles[ref.index].GetBoundingBox();
+	case PRIM_SPHERE: return spheres[ref.index].GetBoundingBox();
+	case PRIM_MOVING_SPHERE: return moving_spheres[ref.index].GetBoundingBox();
+	case PRIM_BOX: return boxes[ref.index].GetBoundingBox();
+	case PRIM_QUANTIZED_TRIANGLE: return quantized_triangles[ref.index].GetBoundingBox();
+	default: return owners[PRIM_OBJECT][ref.index].GetBoundingBox();
+	}
+}
+
+void PrimitiveStore::GetMotionBounds(const PrimRef& ref, AABB& bbox0, AABB& bbox1) const {
+	if (ref.type == PRIM_MOVING_SPHERE) {
+		bbox0 = moving_spheres[ref.index].GetBoundingBox(0.0f);
+		bbox1 = moving_spheres[ref.index].GetBoundingBox(1.0f);
+	}
+	else
+		bbox0 = bbox1 = getBounds(ref);  //static
+}
+
+// The typed primitives do not know which primitive of their object they are; the objects tested through their
+// owner report it themselves (an Instance reports the object hit in its group)
+template <class P>
+static inline void set_prim_id(const P&, const PrimOwner& owner, HitRecord& rec) { rec.prim_id = owner.prim; }
+static inline void set_prim_id(const PrimOwner&, const PrimOwner&, HitRecord&) {}
+
+// Closest hit in a run of references to primitives of one type, stored in prims
+template <class P>
+static bool intersect_run(const vector<P>& prims, const vector<PrimOwner>& owners, const PrimRef* refs, const PrimRef* end,
+	Ray& ray, float& tmin, Object** hit_obj, HitRecord& hit_rec) {
+	bool hit = false;
+	HitRecord rec;
+
+	for (; refs < end; refs++) {
+		if (prims[refs->index].intercepts(ray, rec) && rec.t < tmin) {
+			const PrimOwner& owner = owners[refs->index];
+			tmin = rec.t;
+			hit_rec = rec;
+			set_prim_id(prims[refs->index], owner, hit_rec);
+			*hit_obj = owner.obj;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+template <class P>
+static bool occluded_run(const vector<P>& prims, const PrimRef* refs, const PrimRef* end, Ray& ray) {
+	float t;
+
+	for (; refs < end; refs++) {
+		if (prims[refs->index].intercepts(ray, t) && t > ray.tmin && t < ray.tmax)
+			return true;
+	}
+	return false;
+}
+
+// The objects tested through their owner may have an any-hit test of their own (an Instance traverses its group)
+static bool occluded_run(const vector<PrimOwner>& owners, const PrimRef* refs, const PrimRef* end, Ray& ray) {
+	for (; refs < end; refs++) {
+		if (owners[refs->index].occludes(ray))
+			return true;
+	}
+	return false;
+}
+
+// The references are sorted by type, so each run of one type is tested by a loop specialized for it
+bool PrimitiveStore::intersect(const PrimRef* refs, unsigned int n, Ray& ray, float& tmin, Object** hit_obj, HitRecord& hit_rec) const {
+	const PrimRef* end = refs + n;
+	bool hit = false;
+
+	while (refs < end) {
+		const PrimRef* run_end = refs + 1;
+		while (run_end < end && run_end->type == refs->type)
+			run_end++;
+
+		bool run_hit;
+		switch (refs->type) {
+		case PRIM_TRIANGLE: run_hit = intersect_run(triangles, owners[PRIM_TRIANGLE], refs, run_end, ray, tmin, hit_obj, hit_rec); break;
+		case PRIM_SPHERE: run_hit = intersect_run(spheres, owners[PRIM_SPHERE], refs, run_end, ray, tmin, hit_obj, hit_rec); break;
+		case PRIM_MOVING_SPHERE: run_hit = intersect_run(moving_spheres, owners[PRIM_MOVING_SPHERE], refs, run_end, ray, tmin, hit_obj, hit_rec); break;
+		case PRIM_BOX: run_hit = intersect_run(boxes, owners[PRIM_BOX], refs, run_end, ray, tmin, hit_obj, hit_rec); break;
+		case PRIM_QUANTIZED_TRIANGLE: run_hit = intersect_run(quantized_triangles, owners[PRIM_QUANTIZED_TRIANGLE], refs, run_end, ray, tmin, hit_obj, hit_rec); break;
+		default: run_hit = intersect_run(owners[PRIM_OBJECT], owners[PRIM_OBJECT], refs, run_end, ray, tmin, hit_obj, hit_rec); break;
+		}
+		if (run_hit)
+			hit = true;
+		refs = run_end;
+	}
+	return hit;
+}
+
+bool PrimitiveStore::occluded(const PrimRef* refs, unsigned int n, Ray& ray) const {
+	const PrimRef* end = refs + n;
+
+	while (refs < end) {
+		const PrimRef* run_end = refs + 1;
+		while (run_end < end && run_end->type == refs->type)
+			run_end++;
+
+		bool run_hit;
+		switch (refs->type) {
+		case PRIM_TRIANGLE: run_hit = occluded_run(triangles, refs, run_end, ray); break;
+		case PRIM_SPHERE: run_hit = occluded_run(spheres, refs, run_end, ray); break;
+		case PRIM_MOVING_SPHERE: run_hit = occluded_run(moving_spheres, refs, run_end, ray); break;
+		case PRIM_BOX: run_hit = occluded_run(boxes, refs, run_end, ray); break;
+		case PRIM_QUANTIZED_TRIANGLE: run_hit = occluded_run(quantized_triangles, refs, run_end, ray); break;
+		default: run_hit = occluded_run(owners[PRIM_OBJECT], refs, run_end, ray); break;
+		}
+		if (run_hit)
+			return true;
+		refs = run_end;
+	}
+	return false;
+}
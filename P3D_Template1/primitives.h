@@ -0,0 +1,153 @@
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include "scene.h"
+
+/* Render representation of the scene geometry. After loading, every object is compiled (Object::Compile) into
+   one contiguous array of plain primitives per type, which the acceleration structures reference by (type, index)
+   and test without virtual calls. Objects of any other type are kept as PRIM_OBJECT and tested through Object. */
+
+enum PrimType { PRIM_TRIANGLE, PRIM_SPHERE, PRIM_MOVING_SPHERE, PRIM_BOX, PRIM_QUANTIZED_TRIANGLE, PRIM_OBJECT, PRIM_TYPES };
+
+// Primitive referenced by the acceleration structures; their leaves and cells keep them sorted by type
+struct PrimRef
+{
+	unsigned int type;
+	unsigned int index;  // into the array of its type
+
+	PrimRef(void) : type(PRIM_OBJECT), index(0) {}
+	PrimRef(unsigned int type_, unsigned int index_) : type(type_), index(index_) {}
+	bool operator<(const PrimRef& p) const { return type < p.type; }
+};
+
+// Object a primitive was compiled from, reported with the hits. PRIM_OBJECT primitives are tested through it.
+struct PrimOwner
+{
+	Object* obj;
+	unsigned int prim;  // primitive inside the object, e.g. the face of a mesh
+
+	AABB GetBoundingBox() const { return obj->GetBoundingBox(prim); }
+	bool intercepts(Ray& r, float& t) const { return obj->intercepts(r, prim, t); }
+	bool intercepts(Ray& r, HitRecord& rec) const { return obj->intercepts(r, prim, rec); }
+	bool occludes(Ray& r) const { return obj->occludes(r, prim); }
+};
+
+// Moller-Trumbore test; u and v are the barycentric coordinates of the second and third vertices
+struct TrianglePrim
+{
+	Vector P0, e1, e2;  // first vertex and the edges to the other two
+
+	TrianglePrim(void) {}
+	TrianglePrim(const Vector& P0_, const Vector& P1, const Vector& P2);
+	AABB GetBoundingBox() const;
+	Vector getNormal() const;  // same orientation as Triangle: -(P2 - P0) % (P1 - P0)
+	bool intercepts(const Ray& r, float& t, float& u, float& v) const;
+	bool intercepts(const Ray& r, float& t) const { float u, v; return intercepts(r, t, u, v); }
+	bool intercepts(const Ray& r, HitRecord& rec) const;
+};
+
+// Face of a quantized mesh, decoded when it is tested. The BVH does not copy it to its triangle blocks, which
+// would hold the decoded floats again.
+struct QuantizedTrianglePrim
+{
+	const QuantizedMesh* mesh;
+	unsigned int face;
+
+	QuantizedTrianglePrim(void) {}
+	QuantizedTrianglePrim(const QuantizedMesh* mesh_, unsigned int face_) : mesh(mesh_), face(face_) {}
+	TrianglePrim decode() const;
+	AABB GetBoundingBox() const { return decode().GetBoundingBox(); }  // of the same floats as the test, padded by EPSILON
+	bool intercepts(const Ray& r, float& t) const { return decode().intercepts(r, t); }
+	bool intercepts(const Ray& r, HitRecord& rec) const { return decode().intercepts(r, rec); }
+};
+
+struct SpherePrim
+{
+	Vector center;
+	float radius, SqRadius;
+
+	SpherePrim(void) {}
+	SpherePrim(const Vector& center_, float radius_) : center(center_), radius(radius_), SqRadius(radius_ * radius_) {}
+	AABB GetBoundingBox() const;
+	Vector getNormal(const Ray& r, float t) const { return (r.origin + r.direction * t - center).normalize(); }
+	bool intercepts(const Ray& r, float& t) const;
+	bool intercepts(const Ray& r, HitRecord& rec) const;
+};
+
+// Sphere moving linearly from center_0 at time0 to center_1 at time1. The camera samples the ray times in the
+// shutter interval [0, 1], which may extend the motion beyond [time0, time1].
+struct MovingSpherePrim
+{
+	Vector center_0, center_1;
+	float radius, SqRadius;
+	float time0, time1;
+
+	MovingSpherePrim(void) {}
+	MovingSpherePrim(const Vector& center_0_, const Vector& center_1_, float radius_, float time0_, float time1_) :
+		center_0(center_0_), center_1(center_1_), radius(radius_), SqRadius(radius_ * radius_), time0(time0_), time1(time1_) {}
+	Vector centerAt(float time) const;
+	AABB GetBoundingBox() const;  // swept over the whole shutter interval
+	AABB GetBoundingBox(float time) const { return SpherePrim(centerAt(time), radius).GetBoundingBox(); }
+	bool intercepts(const Ray& r, float& t) const;
+	bool intercepts(const Ray& r, HitRecord& rec) const;
+};
+
+struct BoxPrim
+{
+	Vector min, max;
+
+	BoxPrim(void) {}
+	BoxPrim(const Vector& min_, const Vector& max_) : min(min_), max(max_) {}
+	AABB GetBoundingBox() const { return AABB(min, max); }
+	bool intercepts(const Ray& r, float& t) const;
+	bool intercepts(const Ray& r, HitRecord& rec) const;
+};
+
+
+class PrimitiveStore
+{
+public:
+	vector<TrianglePrim> triangles;
+	vector<SpherePrim> spheres;
+	vector<MovingSpherePrim> moving_spheres;
+	vector<BoxPrim> boxes;
+	vector<QuantizedTrianglePrim> quantized_triangles;
+
+	void Compile(vector<Object*>& objs, bool mid_shutter = false);  // appends the primitives of all the objects and updates the bounds cache
+	void add(const TrianglePrim& tri, Object* obj, unsigned int prim);
+	void add(const SpherePrim& sphere, Object* obj);
+	void add(const MovingSpherePrim& sphere, Object* obj);
+	void add(const BoxPrim& box, Object* obj);
+	void add(const QuantizedTrianglePrim& tri, Object* obj, unsigned int prim);
+	void addObject(Object* obj, unsigned int prim);
+	void Clear();  // removes all the primitives, keeping the memory for compiling the same objects again
+
+	unsigned int size() const;
+	void getRefs(vector<PrimRef>& refs) const;  // references to all the primitives, sorted by type
+	const PrimOwner& getOwner(const PrimRef& ref) const { return owners[ref.type][ref.index]; }
+	AABB GetBoundingBox(const PrimRef& ref) const;  // computed from the primitive
+	// Bounds at the shutter open (time 0) and close (time 1): those at any time in between are their linear interpolation
+	void GetMotionBounds(const PrimRef& ref, AABB& bbox0, AABB& bbox1) const;
+
+	// Bounds and centroids of all the primitives, computed once, in a flat array indexed by primitive id.
+	// computeBounds() must be called again after primitives are added. The moving primitives are bounded over
+	// the whole shutter, or at its middle for trees whose nodes are then bounded over time (MotionBVH).
+	void computeBounds(bool mid_shutter = false);
+	void releaseBounds();  // frees the cache once the accelerator is built; getBounds() and getCentroid() need computeBounds() again
+	unsigned int getId(const PrimRef& ref) const { return first_id[ref.type] + ref.index; }
+	const AABB& getBounds(const PrimRef& ref) const { return bounds[getId(ref)]; }
+	const Vector& getCentroid(const PrimRef& ref) const { return centroids[getId(ref)]; }
+
+	// Closest hit among refs[0, n), sorted by type. Returns true, updating tmin, hit_obj and hit_rec, when a hit closer than tmin is found.
+	bool intersect(const PrimRef* refs, unsigned int n, Ray& ray, float& tmin, Object** hit_obj, HitRecord& hit_rec) const;
+	// Any hit in [ray.tmin, ray.tmax] among refs[0, n)
+	bool occluded(const PrimRef* refs, unsigned int n, Ray& ray) const;
+
+private:
+	vector<PrimOwner> owners[PRIM_TYPES];  // per type, parallel to its array; PRIM_OBJECT has no other data
+	unsigned int first_id[PRIM_TYPES] = {}; // the ids of each type follow those of the previous types
+	vector<AABB> bounds;
+	vector<Vector> centroids;
+};
+
+#endif
@@ -1,16 +1,19 @@
 #ifndef RAY_H
 #define RAY_H
 
+#include <float.h>
 #include "vector.h"
 
 class Ray
 {
 public:
-	Ray(const Vector& o, const Vector& dir ) : origin(o), direction(dir), time(0.0f) {};
-	Ray(const Vector& o, const Vector& dir,  float time) : origin(o), direction(dir), time(time) {};
+	Ray(void) : time(0.0f), tmin(0.0f), tmax(FLT_MAX) {};
+	Ray(const Vector& o, const Vector& dir ) : origin(o), direction(dir), time(0.0f), tmin(0.0f), tmax(FLT_MAX) {};
+	Ray(const Vector& o, const Vector& dir,  float time) : origin(o), direction(dir), time(time), tmin(0.0f), tmax(FLT_MAX) {};
 
 	Vector origin;
 	Vector direction;
 	float time;
+	float tmin, tmax;  // interval of the ray parameter in which hits count (for shadow rays: up to the light)
 };
 #endif
\ No newline at end of file
@@ -4,10 +4,60 @@
 #include <stack>
 #include <queue>
 #include <cmath>
+#include <string.h>
 #include "scene.h"
+#include "primitives.h"
+#include "simd.h"
+#include "rayPacket.h"
 
 using namespace std;
 
+class ThreadPool;
+
+#define GRID_MAILBOX_SIZE 64  // entries of the per-thread mailbox of the grid traversals (a power of two)
+#define GRID_BUILD_CHUNK 16384 // objects, or cells, per task of the parallel grid build
+#define GRID_SLABS_PER_THREAD 4 // slabs of cells per thread of the parallel grid build
+#define GRID_COST_STEP 1.0f    // cost model of the grid resolution: cost of visiting a cell...
+#define GRID_COST_TEST 6.0f    // ...and of testing a primitive. Tunable: the higher, the finer the cells it picks
+
+/* Mailbox of the grid traversals of one thread: the primitives tested by its current ray, hashed by primitive id
+   into a small direct-mapped table, so that an object spanning several cells is tested only once per ray.
+   A collision evicts the older entry, whose primitive is then just tested again. */
+struct GridMailbox
+{
+	unsigned int ray = 0;                    // id of the current ray of the thread
+	unsigned int prim[GRID_MAILBOX_SIZE];
+	unsigned int stamp[GRID_MAILBOX_SIZE];   // ray that tested prim, 0 if none
+	vector<PrimRef> untested;                // primitives of the current cell not tested yet
+	unsigned long long tests = 0, saved = 0;
+
+	GridMailbox();
+	~GridMailbox();
+
+	void newRay() {
+		if (++ray == 0) {  //wrapped around: forget the old stamps
+			memset(stamp, 0, sizeof(stamp));
+			ray = 1;
+		}
+	}
+
+	// Returns true if the current ray already tested the primitive, and otherwise records it
+	bool tested(unsigned int id) {
+		unsigned int slot = (id * 2654435761u) & (GRID_MAILBOX_SIZE - 1);
+		if (stamp[slot] == ray && prim[slot] == id)
+			return true;
+		stamp[slot] = ray;
+		prim[slot] = id;
+		return false;
+	}
+
+	// Copies those of refs[0, n) that the current ray has not tested to untested, in the same order, and marks
+	// them as tested. Returns their number.
+	unsigned int filter(const PrimitiveStore& prims, const PrimRef* refs, unsigned int n);
+};
+
+GridMailbox& gridMailbox();  // of the calling thread
+
 class Grid
 {
 public:
@@ -17,16 +67,49 @@ public:
 	void addObject(Object* o);
 	void setAABB(AABB& bbox_);
 	Object* getObject(unsigned int index);
-	void Build(vector<Object*>& objs);   // set up grid cells
-	bool Traverse(Ray& ray, Object **hitobject, Vector& hitpoint);  //(const Ray& ray, double& tmin, ShadeRec& sr)
-	bool Traverse(Ray& ray);  //Traverse for shadow ray
+	// Sets up the grid cells, in parallel on the pool if given. With sample rays (e.g. primary rays of the camera),
+	// the resolution is the one of least predicted cost for them rather than that of the initial m.
+	// The primary sample_rays and their shadow rays to sample_lights drive the choice of the resolution
+	void Build(vector<Object*>& objs, ThreadPool* pool = NULL, const vector<Ray>& sample_rays = vector<Ray>(),
+		const vector<Vector>& sample_lights = vector<Vector>());
+	bool Traverse(Ray& ray, Object **hitobject, HitRecord& hit);  //(const Ray& ray, double& tmin, ShadeRec& sr)
+	bool Occluded(Ray& ray);  //any hit for shadow rays, up to ray.tmax
+
+	// Primitive tests of the grid traversals (of both grids) of all the threads since the last ResetStats(), and
+	// the tests saved by mailboxing. Read them while no ray is being traced.
+	static void GetStats(unsigned long long& tests, unsigned long long& saved);
+	static void ResetStats();
 
 private:
-	vector<Object *> objects;
-	vector<vector<Object*> > cells;
+	PrimitiveStore prims;     // the objects compiled into typed primitives
+	vector<PrimRef> objects;
+
+	// Cells in compressed sparse row layout: the primitives of cell i are cell_prims[cell_offsets[i], cell_offsets[i + 1]),
+	// so an empty cell costs one offset. Those that also overlap other cells, which a ray may test again, come first
+	// (cell_shared[i] of them) and are checked against the mailbox; each part is sorted by type.
+	vector<unsigned int> cell_offsets;  // nx * ny * nz + 1 entries
+	vector<unsigned int> cell_shared;   // nx * ny * nz entries
+	vector<PrimRef> cell_prims;
+
+	struct CellSpan {  // view of the primitives of one cell, into cell_prims
+		const PrimRef* first;
+		unsigned int count;
+		unsigned int shared;  // the first ones, which overlap other cells
+	};
+	CellSpan getCell(int ix, int iy, int iz) const {
+		int index = ix + nx * iy + nx * ny * iz;
+		return CellSpan{ cell_prims.data() + cell_offsets[index], cell_offsets[index + 1] - cell_offsets[index], cell_shared[index] };
+	}
+	CellSpan untested(CellSpan cell, GridMailbox& mailbox) const;  // the shared primitives the current ray has not tested
 
 	int nx, ny, nz; // number of cells in the x, y, and z directions
-	float m = 2.0f; // factor that allows to vary the number of cells
+	float m = 2.0f; // factor that allows to vary the number of cells: cells per object along each axis
+
+	void setResolution(float m_);
+	void getCellRange(const PrimRef& obj, int& ixmin, int& iymin, int& izmin, int& ixmax, int& iymax, int& izmax) const;
+	void buildCells(ThreadPool* pool);
+	void traceSampleRays(const vector<Ray>& sample_rays, const vector<Vector>& sample_lights, ThreadPool* pool, vector<Ray>& rays, vector<float>& t_hit);
+	float chooseResolution(const vector<Ray>& rays, const vector<float>& t_hit, ThreadPool* pool, float& current_cost, float& best_cost);
 
 	//Setup function for Grid traversal
 	bool Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, double& tx_next, double& ty_next, double& tz_next, 
@@ -35,63 +118,295 @@ private:
 	AABB bbox;
 };
 
-/*********************************BVH*****************************************************************/
-class BVH
+/* Two-level grid for scenes of uneven density, e.g. a detailed model on a large floor, where the uniform grid has
+   either too few cells for the model or too many for the rest. A coarse top grid is built over the scene, and each
+   of its cells with more than HGRID_MAX_CELL_PRIMS primitives holds a sub-grid over the cell, whose resolution
+   comes from its own primitive count as that of the uniform grid comes from the whole scene's. The traversal walks
+   the top grid and, in a subdivided cell, walks its sub-grid over the part of the ray inside the cell. */
+#define HGRID_MAX_CELL_PRIMS 8  // top cells with more primitives than the mean 1 / m_top^3 are subdivided
+
+class HierarchicalGrid
 {
-	class Comparator {
-	public:
-		int dimension;
+public:
+	HierarchicalGrid(void);
+	int getNumObjects();
+	void Build(vector<Object*>& objs, ThreadPool* pool = NULL);  // the sub-grids are built in parallel on the pool
+	bool Traverse(Ray& ray, Object** hitobject, HitRecord& hit);
+	bool Occluded(Ray& ray);  //any hit for shadow rays, up to ray.tmax
 
-		bool operator() (Object* a, Object* b) {
-			float ca = a->GetBoundingBox().centroid().getAxisValue(dimension);
-			float cb = b->GetBoundingBox().centroid().getAxisValue(dimension);
-			return ca < cb;
-		}
+private:
+	PrimitiveStore prims;     // the objects compiled into typed primitives
+
+	// Uniform grid over bbox with the cell layout of Grid: the top grid, or the sub-grid of a top cell. The shared
+	// primitives of a sub-grid cell are those that overlap other cells of either level.
+	struct Level {
+		AABB bbox;
+		int nx, ny, nz;
+		Vector cell_size;
+		vector<unsigned int> cell_offsets;  // nx * ny * nz + 1 entries
+		vector<unsigned int> cell_shared;   // nx * ny * nz entries
+		vector<PrimRef> cell_prims;
+
+		size_t getMemorySize() const;
 	};
+	Level top;                // a subdivided cell has no primitives at this level
+	vector<int> top_sub;      // index of the sub-grid of every top cell into subgrids, -1 if none
+	vector<Level> subgrids;
+
+	float m_top = 0.5f;  // factor of the number of cells of the top grid, 1 / m_top^3 = 8 primitives per cell. Tunable
+	float m = 2.0f;      // factor of the number of cells of the sub-grids, as in Grid
 
+	// Sets up level over bbox with the primitives refs[0, n), the first n_shared of which overlap other cells of
+	// the enclosing level, at m * (n / volume)^(1/3) cells per unit of length
+	void buildLevel(Level& level, const AABB& bbox, const PrimRef* refs, unsigned int n, unsigned int n_shared, float m);
+	// Visits the cells of level pierced by the ray in [t0, t1], in order, calling visit(cell, t_in, t_out) with
+	// the part of the ray in the cell until it returns true
+	template <class Visit> bool walk(const Level& level, const Ray& ray, float t0, float t1, Visit visit) const;
+};
+
+/*********************************BVH*****************************************************************/
+#define SAH_BINS 16  // number of bins per axis of the BVH builder
+#define BVH_TASK_SIZE 4096  // the builder spawns a task for each child of a node with more objects
+#define BVH_BIN_CHUNK 16384 // objects per binning task; fixed so that the tree does not depend on the thread count
+#define PACKET_MIN_RAYS 3   // a packet that enters a node with fewer rays continues as single rays
+#define BVH_REBUILD_THRESHOLD 0.5f  // Update() rebuilds the tree when refitting raised its SAH cost by more than this fraction
+#define TRI_BLOCK_SIZE SIMD_WIDTH  // triangles intersected together in the leaves: 4 with SSE, 8 with AVX2
+#define SPHERE_BLOCK_SIZE SIMD_WIDTH  // spheres intersected together in the leaves
+
+class BVH
+{
+	// 32-byte node. All nodes live in one contiguous array in depth-first order:
+	// the left child of an interior node is the node that follows it.
 	class BVHNode {
 	private:
-		AABB bbox;
-		bool leaf;
+		float bmin[3], bmax[3];
+		unsigned int index;	// if n_objs == 0: index of the right child node,
+							// else: index to first Intersectable (PrimRef) in objects vector
 		unsigned int n_objs;
-		unsigned int index;	// if leaf == false: index to left child node,
-							// else if leaf == true: index to first Intersectable (Object *) in objects vector
 
 	public:
-		BVHNode(void);
 		void setAABB(AABB& bbox_);
 		void makeLeaf(unsigned int index_, unsigned int n_objs_);
-		void makeNode(unsigned int left_index_);
-		bool isLeaf() { return leaf; }
-		unsigned int getIndex() { return index; }
-		unsigned int getNObjs() { return n_objs; }
-		AABB& getAABB() { return bbox; };
+		void makeNode(unsigned int right_index_);
+		bool isLeaf() const { return n_objs != 0; }
+		unsigned int getIndex() const { return index; }
+		unsigned int getNObjs() const { return n_objs; }
+		AABB getAABB() const;
+		bool intercepts(const Vector& origin, const Vector& inv_dir, float& t) const;
+		// Packet tests, for rays whose directions have the given signs (1 = negative) on the three axes
+		int interceptsPacket(const RayPacket& packet, const int* sign, float& t_entry) const;
+		bool interceptsFrustum(const float* o_min, const float* o_max, const float* inv_min, const float* inv_max, const int* sign) const;
 	};
+	static_assert(sizeof(BVHNode) == 32, "two BVH nodes must fit in one cache line");
+	friend class WideBVH;
+	friend class MotionBVH;
 
-private:
-	int Threshold = 2;
-	int sah_splits = 0;
-	vector<Object*> objects;
-	vector<BVH::BVHNode*> nodes;
+	// Up to TRI_BLOCK_SIZE triangles of one leaf in SoA layout, with precomputed edges, tested at once by one
+	// SIMD Moller-Trumbore kernel. Unused lanes have null edges and are never hit. The blocks are the only copy
+	// of the triangles kept after a build or a refit: the TrianglePrims they are filled from are then freed.
+	struct TriangleBlock {
+		float v0[3][TRI_BLOCK_SIZE], e1[3][TRI_BLOCK_SIZE], e2[3][TRI_BLOCK_SIZE];
+		unsigned int ref[TRI_BLOCK_SIZE];  // index of the triangle in the objects vector
+
+		TriangleBlock(void);
+		void setTriangle(int lane, const TrianglePrim& tri, unsigned int ref_);
+		Vector getNormal(int lane) const;  // as TrianglePrim::getNormal
+		// Returns the lane of the nearest hit with tmin <= t < tmax, or -1, with its distance and barycentric coordinates
+		int intercepts(const Ray& ray, float tmin, float tmax, float& t, float& u, float& v) const;
+	};
+
+	// Up to SPHERE_BLOCK_SIZE spheres of one leaf in SoA layout, tested at once by one SIMD kernel.
+	// Unused lanes have a negative squared radius and are never hit. Like the triangle blocks, the only copy of the spheres.
+	struct SphereBlock {
+		float center[3][SPHERE_BLOCK_SIZE], SqRadius[SPHERE_BLOCK_SIZE];
+		unsigned int ref[SPHERE_BLOCK_SIZE];  // index of the sphere in the objects vector
 
+		SphereBlock(void);
+		void setSphere(int lane, const SpherePrim& sphere, unsigned int ref_);
+		Vector getNormal(int lane, const Ray& r, float t) const;  // as SpherePrim::getNormal
+		// Returns the lane of the nearest hit with tmin < t < tmax, or -1, with its distance
+		int intercepts(const Ray& ray, float tmin, float tmax, float& t) const;
+	};
+
+	// Blocks of the leaf whose first object is objects[i]. The leaf is sorted by primitive type: its triangles
+	// come first (objects [i, i + n_tris)), then its spheres, each packed in consecutive blocks of their kind.
+	struct LeafBlocks {
+		unsigned int first_tri_block, n_tris;
+		unsigned int first_sphere_block, n_spheres;
+	};
+
+public:
+	// Entry of the traversal stack. The stack array is owned by the caller (e.g. one per thread)
+	// and must hold at least getStackSize() items.
 	struct StackItem {
-		BVHNode* ptr;
+		const BVHNode* ptr;
 		float t;
-		StackItem(BVHNode* _ptr, float _t) : ptr(_ptr), t(_t) { }
+		StackItem(void) : ptr(NULL), t(0.0f) { }
+		StackItem(const BVHNode* _ptr, float _t) : ptr(_ptr), t(_t) { }
 	};
 
-	stack<StackItem> hit_stack;
+private:
+	int Threshold = 2;           // nodes with up to Threshold objects are always leaves
+	int MaxLeafSize = 8;         // nodes with more objects are always split
+	float cost_traversal = 1.0f; // SAH costs of a node traversal step and of an object intersection
+	float cost_intersection = 1.5f;
+	int max_depth = 0;
+	bool mid_shutter_bounds = false;  // build over the moving primitives at mid-shutter (set by MotionBVH)
+	bool keep_bounds = false;         // keep the bounds cache of prims after the build (set by MotionBVH, which reads it)
+	vector<Object*> source_objs;      // objects of the last build, compiled again by Refit()
+	float build_cost = 0.0f;          // SAH cost after the last build
+	PrimitiveStore prims;             // the objects compiled into typed primitives, but the triangles and spheres, held by the leaf blocks
+	vector<PrimRef> objects;          // references to prims, in leaf order
+	BVHNode* nodes = NULL;            // cache-line aligned, n_nodes entries
+	unsigned int n_nodes = 0;
+	TriangleBlock* tri_blocks = NULL;  // aligned, n_tri_blocks entries
+	unsigned int n_tri_blocks = 0;
+	SphereBlock* sphere_blocks = NULL;  // aligned, n_sphere_blocks entries
+	unsigned int n_sphere_blocks = 0;
+	vector<LeafBlocks> leaf_blocks;    // indexed by the first object of each leaf; empty without triangles and spheres
+
+	struct SAHBin {
+		AABB bbox;
+		int count;
+	};
+
+	void clear();
+	void pack_leaves();
+	void fill_leaf_blocks(unsigned int first);
+	void release_blocked_prims();
+	bool intersect_leaf(unsigned int first, unsigned int n_objs, Ray& ray, float& tmin, Object** hit_obj, HitRecord& hit_rec) const;
+	bool occluded_leaf(unsigned int first, unsigned int n_objs, Ray& ray) const;
+	bool traverse_subtree(const BVHNode* start_node, Ray& ray, const Vector& inv_dir, float& tmin, Object** hit_obj, HitRecord& hit_rec, StackItem* stack) const;
 
 public:
 	BVH(void);
+	~BVH(void);
+	BVH(const BVH&) = delete;             // owns its aligned node and block arrays
+	BVH& operator=(const BVH&) = delete;
 	int getNumObjects();
-	void Build(vector<Object*>& objects);
-	void build_recursive(int left_index, int right_index, BVHNode* node);
-	int find_split(int left_index, int right_index, BVHNode* node);
-	AABB build_bbox(int left_index, int right_index);
-	int SAH(int left_index, int right_index, BVHNode* node);
+	int getStackSize() const { return max_depth + 1; }
+	int getPacketStackSize() const { return 2 * getStackSize(); }
+	void Build(vector<Object*>& objects, ThreadPool* pool = NULL);
+	// Animation: after the objects of the last build have moved (Object::Translate), Refit() compiles them again and
+	// recomputes the node bounds bottom-up, keeping the tree. The objects must keep their number of primitives.
+	void Refit(ThreadPool* pool = NULL);
+	// Refits the tree, or rebuilds it when refitting degraded its SAH cost past BVH_REBUILD_THRESHOLD. Returns true on a rebuild.
+	bool Update(ThreadPool* pool = NULL);
+	int build_recursive(int left_index, int right_index, AABB& bbox, vector<BVHNode>& node_list, int depth, ThreadPool* pool);
+	int SAH(int left_index, int right_index, AABB& bbox, AABB& left_bbox, AABB& right_bbox, ThreadPool* pool);
+	void bin_objects(int left_index, int right_index, AABB& centroid_bbox, SAHBin bins[3][SAH_BINS]);
+	AABB centroid_bounds(int left_index, int right_index);
 	AABB build_bounding_box(int left_index, int right_index);
-	bool Traverse(Ray& ray, Object** hit_obj, Vector& hit_point);
-	bool Traverse(Ray& ray);
+	float SAHCost() const;
+	bool Traverse(Ray& ray, Object** hit_obj, HitRecord& hit_rec, StackItem* stack) const;
+	bool Occluded(Ray& ray, StackItem* stack) const;  //any hit for shadow rays: true at the first object hit in [ray.tmin, ray.tmax]
+	// Closest hits of a packet of rays: hit_obj and hit_rec hold RAY_PACKET_SIZE entries and hit_obj must be NULL initialized
+	bool TraversePacket(RayPacket& packet, Object** hit_obj, HitRecord* hit_rec, StackItem* stack) const;
+};
+
+/*********************************Wide BVH************************************************************/
+#define WBVH_WIDTH SIMD_WIDTH  // children per node: BVH4 with SSE, BVH8 with AVX2
+
+// BVH with up to WBVH_WIDTH children per node, collapsed from the binary SAH tree.
+// Each node stores the bounds of its children in SoA layout, so one SIMD slab test covers all of them.
+class WideBVH
+{
+	class WideNode {
+	private:
+		float bmin[3][WBVH_WIDTH], bmax[3][WBVH_WIDTH];
+		unsigned int index[WBVH_WIDTH];   // if n_objs == 0: index of the child node,
+		                                  // else: index to first Intersectable (PrimRef) in objects vector
+		unsigned int n_objs[WBVH_WIDTH];
+
+	public:
+		WideNode(void);  // all slots empty: their boxes can never be hit
+		void setChild(int slot, AABB& bbox_, unsigned int index_, unsigned int n_objs_);
+		unsigned int getIndex(int slot) const { return index[slot]; }
+		unsigned int getNObjs(int slot) const { return n_objs[slot]; }
+		// Slab test of all the children; returns the mask of children entered before tmax and their entry distances
+		int intercepts(const Vector& origin, const Vector& inv_dir, float tmax, float* t) const;
+	};
+	static_assert(sizeof(WideNode) % 64 == 0, "wide nodes must be a whole number of cache lines");
+
+public:
+	// Entry of the traversal stack: a child node, or a leaf when n_objs != 0
+	struct StackItem {
+		unsigned int index;
+		unsigned int n_objs;
+		float t;
+		StackItem(void) : index(0), n_objs(0), t(0.0f) { }
+		StackItem(unsigned int _index, unsigned int _n_objs, float _t) : index(_index), n_objs(_n_objs), t(_t) { }
+	};
+
+private:
+	BVH bvh;                  // binary tree the wide tree is collapsed from; owns the objects vector
+	WideNode* nodes = NULL;   // cache-line aligned, n_nodes entries
+	unsigned int n_nodes = 0;
+	int max_depth = 0;
+
+	int collapse(unsigned int bin_index, vector<WideNode>& node_list, int depth);
+
+public:
+	WideBVH(void);
+	~WideBVH(void);
+	WideBVH(const WideBVH&) = delete;             // owns its aligned node array
+	WideBVH& operator=(const WideBVH&) = delete;
+	int getNumObjects();
+	int getStackSize() const { return (max_depth + 1) * (WBVH_WIDTH - 1) + 1; }
+	void Build(vector<Object*>& objects, ThreadPool* pool = NULL);
+	bool Traverse(Ray& ray, Object** hit_obj, HitRecord& hit_rec, StackItem* stack) const;
+	bool Occluded(Ray& ray, StackItem* stack) const;  //any hit for shadow rays, up to ray.tmax
+};
+
+/*********************************Motion BVH**********************************************************/
+// BVH for motion blur. Every node stores its bounds at the shutter open (time 0) and close (time 1), and the
+// traversal tests the box interpolated at the ray's time, which stays tight around moving primitives where
+// a box swept over the whole shutter would not. The tree is the binary SAH tree with its nodes refitted.
+class MotionBVH
+{
+	class MotionNode {
+	private:
+		float bmin[3], bmax[3];        // at time 0
+		float dmin[3], dmax[3];        // motion of the bounds up to time 1
+		unsigned int index;  // if n_objs == 0: index of the right child node (the left one follows its parent),
+		                     // else: index to first Intersectable (PrimRef) in objects vector
+		unsigned int n_objs;
+		unsigned int pad[2];
+
+	public:
+		void setAABB(AABB& bbox0, AABB& bbox1);
+		void setNode(unsigned int index_, unsigned int n_objs_) { index = index_; n_objs = n_objs_; }
+		bool isLeaf() const { return n_objs != 0; }
+		unsigned int getIndex() const { return index; }
+		unsigned int getNObjs() const { return n_objs; }
+		// Slab test of the box at the given time in [0, 1], with the same conventions as BVHNode::intercepts
+		bool intercepts(const Vector& origin, const Vector& inv_dir, float time, float& t) const;
+	};
+	static_assert(sizeof(MotionNode) == 64, "a motion node must fill one cache line");
+
+public:
+	// Entry of the traversal stack
+	struct StackItem {
+		unsigned int index;
+		float t;
+		StackItem(void) : index(0), t(0.0f) { }
+		StackItem(unsigned int _index, float _t) : index(_index), t(_t) { }
+	};
+
+private:
+	BVH bvh;                    // binary tree the motion tree is refitted from; owns the objects vector
+	MotionNode* nodes = NULL;   // cache-line aligned, n_nodes entries, in the same order as the binary tree
+	unsigned int n_nodes = 0;
+
+public:
+	MotionBVH(void);
+	~MotionBVH(void);
+	MotionBVH(const MotionBVH&) = delete;             // owns its aligned node array
+	MotionBVH& operator=(const MotionBVH&) = delete;
+	int getNumObjects();
+	int getStackSize() const { return bvh.getStackSize(); }
+	void Build(vector<Object*>& objects, ThreadPool* pool = NULL);
+	bool Traverse(Ray& ray, Object** hit_obj, HitRecord& hit_rec, StackItem* stack) const;
+	bool Occluded(Ray& ray, StackItem* stack) const;  //any hit for shadow rays, up to ray.tmax
 };
 #endif
\ No newline at end of file
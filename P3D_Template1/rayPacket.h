@@ -0,0 +1,39 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <float.h>
+#include "ray.h"
+#include "simd.h"
+
+#define RAY_PACKET_SIZE 16  // rays traced together, a multiple of SIMD_WIDTH
+
+// Coherent rays (e.g. the primary rays of neighbouring pixels) traced together through the BVH, in SoA layout.
+// Lanes without a ray have tmax < 0 so that no box or object is ever hit by them.
+struct RayPacket
+{
+	alignas(32) float ox[RAY_PACKET_SIZE], oy[RAY_PACKET_SIZE], oz[RAY_PACKET_SIZE];
+	alignas(32) float dx[RAY_PACKET_SIZE], dy[RAY_PACKET_SIZE], dz[RAY_PACKET_SIZE];
+	alignas(32) float ix[RAY_PACKET_SIZE], iy[RAY_PACKET_SIZE], iz[RAY_PACKET_SIZE];  // reciprocal directions
+	alignas(32) float tmax[RAY_PACKET_SIZE];  // distance of the closest hit found so far
+
+	RayPacket(void) {
+		for (int i = 0; i < RAY_PACKET_SIZE; i++) {
+			ox[i] = oy[i] = oz[i] = 0.0f;
+			dx[i] = dy[i] = dz[i] = 1.0f;
+			ix[i] = iy[i] = iz[i] = 1.0f;
+			tmax[i] = -1.0f;
+		}
+	}
+
+	void setRay(int lane, const Ray& r) {
+		ox[lane] = r.origin.x; oy[lane] = r.origin.y; oz[lane] = r.origin.z;
+		dx[lane] = r.direction.x; dy[lane] = r.direction.y; dz[lane] = r.direction.z;
+		ix[lane] = 1.0f / r.direction.x; iy[lane] = 1.0f / r.direction.y; iz[lane] = 1.0f / r.direction.z;
+		tmax[lane] = r.tmax;  // only hits closer than the ray's tmax are searched
+	}
+
+	bool isActive(int lane) const { return tmax[lane] >= 0.0f; }
+	Ray getRay(int lane) const { return Ray(Vector(ox[lane], oy[lane], oz[lane]), Vector(dx[lane], dy[lane], dz[lane])); }
+};
+
+#endif
@@ -1,19 +1,17 @@
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <algorithm>
 
 #include "maths.h"
 #include "scene.h"
+#include "primitives.h"
+#include "rayAccelerator.h"
 #include "macros.h"
 
-float GetDeterminant2x2(float f1, float f2, float f3, float f4) {
-	return (f1 * f4) - (f2 * f3);
-}
-
-float GetDeterminant3x3(Vector v1, Vector v2, Vector v3) {
-	return v1.x * GetDeterminant2x2(v2.y, v2.z, v3.y, v3.z) 
-		- v1.y * GetDeterminant2x2(v2.x, v2.z, v3.x, v3.z)  
-		+ v1.z * GetDeterminant2x2(v2.x, v2.y, v3.x, v3.y);
+void Object::Compile(PrimitiveStore& store) {
+	for (unsigned int p = 0; p < GetNumPrimitives(); p++)
+		store.addObject(this, p);
 }
 
 Triangle::Triangle(Vector& P0, Vector& P1, Vector& P2)
@@ -48,31 +46,181 @@ AABB Triangle::GetBoundingBox() {
 	return(AABB(Min, Max));
 }
 
-Vector Triangle::getNormal(Vector point)
-{
-	return normal;
-}
-
 //
 // Ray/Triangle intersection test using Tomas Moller-Ben Trumbore algorithm.
 //
 
 bool Triangle::intercepts(Ray& r, float& t) {
+	float beta, gamma;
+	return intersect(r, t, beta, gamma);
+}
 
-	Vector o_a = r.origin - points[0];
-	Vector c_a = points[2] - points[0];
-	Vector _d = r.direction * (-1);
-	Vector b_a = points[1] - points[0];
-	float beta = GetDeterminant3x3(o_a, c_a, _d) / GetDeterminant3x3(b_a, c_a, _d);
+bool Triangle::intercepts(Ray& r, HitRecord& rec) {
+	if (!intersect(r, rec.t, rec.u, rec.v))
+		return false;
+	rec.prim_id = 0;
+	rec.normal = normal;
+	return true;
+}
 
-	if (beta < 0 || beta > 1) return false;
+bool Triangle::intersect(Ray& r, float& t, float& beta, float& gamma) {
+	return TrianglePrim(points[0], points[1], points[2]).intercepts(r, t, beta, gamma);
+}
 
-	float gamma = GetDeterminant3x3(b_a, o_a, _d) / GetDeterminant3x3(b_a, c_a, _d);
-	if (gamma < 0 || beta + gamma > 1) return false;
+void Triangle::Compile(PrimitiveStore& store) {
+	store.add(TrianglePrim(points[0], points[1], points[2]), this, 0);
+}
 
-	t = GetDeterminant3x3(b_a, c_a, o_a) / GetDeterminant3x3(b_a, c_a, _d);
-	if (t < 0) return false;
-	return (true);
+void Triangle::Translate(const Vector& offset) {
+	for (int i = 0; i < 3; i++)
+		points[i] = points[i] + offset;
+	Min = Min + offset;
+	Max = Max + offset;
+}
+
+TriangleMesh::TriangleMesh(vector<Vector>& vertices_, vector<unsigned int>& indices_)
+	: vertices(vertices_), indices(indices_), n_faces(indices_.size() / 3)
+{
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	bbox = AABB(min, max);
+
+	normals.resize(n_faces);
+	for (unsigned int f = 0; f < n_faces; f++) {
+		Vector P0 = vertices[indices[3 * f]], P1 = vertices[indices[3 * f + 1]], P2 = vertices[indices[3 * f + 2]];
+
+		/* Same orientation as Triangle */
+		normals[f] = (P2 - P0) % (P1 - P0);
+		normals[f] *= -1;
+		normals[f].normalize();
+
+		bbox.extend(GetBoundingBox(f));
+	}
+}
+
+TriangleMesh::~TriangleMesh() {
+	delete quantized;
+}
+
+AABB TriangleMesh::GetBoundingBox() {
+	return bbox;
+}
+
+AABB TriangleMesh::GetBoundingBox(unsigned int face) {
+	return getTriangle(face).GetBoundingBox();
+}
+
+TrianglePrim TriangleMesh::getTriangle(unsigned int face) {
+	if (quantized != NULL)
+		return QuantizedTrianglePrim(quantized, face).decode();
+	return TrianglePrim(vertices[indices[3 * face]], vertices[indices[3 * face + 1]], vertices[indices[3 * face + 2]]);
+}
+
+void TriangleMesh::Compile(PrimitiveStore& store) {
+	for (unsigned int f = 0; f < n_faces; f++) {
+		if (quantized != NULL)
+			store.add(QuantizedTrianglePrim(quantized, f), this, f);
+		else
+			store.add(getTriangle(f), this, f);
+	}
+}
+
+void TriangleMesh::Translate(const Vector& offset) {
+	if (quantized != NULL)
+		quantized->origin = quantized->origin + offset;
+	for (Vector& v : vertices)
+		v = v + offset;
+	bbox.min = bbox.min + offset;
+	bbox.max = bbox.max + offset;
+}
+
+/* Every coordinate becomes the nearest of 65536 steps across the mesh bounds, so the error is at most half a
+   step (1/131070 of the extent). The faces are then the decoded triangles: the bounds are recomputed from the
+   decoded vertices, which are also those the intersection tests use, so no hit falls outside them. */
+void TriangleMesh::Quantize() {
+	if (quantized != NULL || n_faces == 0)
+		return;
+
+	quantized = new QuantizedMesh();
+	quantized->origin = bbox.min;
+	Vector extent = bbox.max - bbox.min;
+	quantized->step = extent * (1.0f / 65535.0f);
+
+	quantized->positions.resize(3 * vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++) {
+		Vector q = vertices[i] - quantized->origin;
+		float coords[3] = { q.x, q.y, q.z }, steps[3] = { quantized->step.x, quantized->step.y, quantized->step.z };
+		for (int d = 0; d < 3; d++) {
+			float s = (steps[d] > 0.0f) ? coords[d] / steps[d] + 0.5f : 0.0f;
+			quantized->positions[3 * i + d] = (uint16_t)MIN(MAX(s, 0.0f), 65535.0f);
+		}
+	}
+	quantized->indices.swap(indices);
+
+	//the decoded faces replace the float data
+	vector<Vector>().swap(vertices);
+	vector<Vector>().swap(normals);
+	vector<unsigned int>().swap(indices);
+
+	bbox = GetBoundingBox(0);
+	for (unsigned int f = 1; f < n_faces; f++)
+		bbox.extend(GetBoundingBox(f));
+}
+
+size_t TriangleMesh::getMemorySize() {
+	size_t size = sizeof(TriangleMesh) + vertices.capacity() * sizeof(Vector) + indices.capacity() * sizeof(unsigned int) + normals.capacity() * sizeof(Vector);
+	if (quantized != NULL)
+		size += sizeof(QuantizedMesh) + quantized->positions.capacity() * sizeof(uint16_t) + quantized->indices.capacity() * sizeof(unsigned int);
+	return size;
+}
+
+// The accelerators keep one primitive, its owner and a reference per face. The float faces are TrianglePrims in
+// the grids and lanes of the triangle blocks in the BVH (9 floats and a reference each), which replace them.
+size_t TriangleMesh::getRenderMemorySize() {
+	size_t face_size = (quantized != NULL) ? sizeof(QuantizedTrianglePrim) : MAX(sizeof(TrianglePrim), 10 * sizeof(float));
+	return getMemorySize() + n_faces * (face_size + sizeof(PrimOwner) + sizeof(PrimRef));
+}
+
+bool TriangleMesh::intercepts(Ray& r, float& t) {
+	HitRecord rec;
+	if (!intercepts(r, rec))
+		return false;
+	t = rec.t;
+	return true;
+}
+
+bool TriangleMesh::intercepts(Ray& r, HitRecord& rec) {
+	HitRecord face_rec;
+	bool hit = false;
+
+	rec.t = FLT_MAX;
+	for (unsigned int f = 0; f < n_faces; f++) {
+		if (intercepts(r, f, face_rec) && face_rec.t < rec.t) {
+			rec = face_rec;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+bool TriangleMesh::intercepts(Ray& r, unsigned int face, float& t) {
+	float u, v;
+	return intersect(face, r, t, u, v);
+}
+
+bool TriangleMesh::intercepts(Ray& r, unsigned int face, HitRecord& rec) {
+	if (!intersect(face, r, rec.t, rec.u, rec.v))
+		return false;
+	rec.prim_id = face;
+	rec.normal = (quantized != NULL) ? getTriangle(face).getNormal() : normals[face];
+	return true;
+}
+
+//
+// Ray/Triangle intersection test using Tomas Moller-Ben Trumbore algorithm, on the vertices of one face.
+// u and v are the barycentric coordinates of the second and third vertices.
+//
+bool TriangleMesh::intersect(unsigned int face, Ray& r, float& t, float& u, float& v) {
+	return getTriangle(face).intercepts(r, t, u, v);
 }
 
 Plane::Plane(Vector& a_PN, float a_D)
@@ -111,58 +259,66 @@ bool Plane::intercepts(Ray& r, float& t)
 	return (t > 0);
 }
 
-Vector Plane::getNormal(Vector point)
+void Plane::Translate(const Vector& offset)
 {
-	return PN;
+	D -= PN * offset;
 }
 
-
-bool Sphere::intercepts(Ray& r, float& t)
+bool Plane::intercepts(Ray& r, HitRecord& rec)
 {
-	Vector oc = this->center - r.origin;	
-	float b = r.direction * oc;
-
-	float c = oc * oc - this->SqRadius;
+	if (!intercepts(r, rec.t))
+		return false;
+	rec.prim_id = 0;
+	rec.normal = PN;
+	rec.u = rec.v = 0.0f;
+	return true;
+}
 
-	if (pow(b, 2) - c <= 0) return false;
 
-	if (c > 0.0f) {
-		if (b <= 0.0f) return false;
+bool Sphere::intercepts(Ray& r, float& t)
+{
+	return SpherePrim(center, radius).intercepts(r, t);
+}
 
-		t = b - sqrt(pow(b, 2) - c);
+bool Sphere::intercepts(Ray& r, HitRecord& rec)
+{
+	return SpherePrim(center, radius).intercepts(r, rec);
+}
 
-	}
-	else t = b + sqrt(pow(b, 2) - c);
+void Sphere::Compile(PrimitiveStore& store)
+{
+	store.add(SpherePrim(center, radius), this);
+}
 
-	return true;
+void Sphere::Translate(const Vector& offset)
+{
+	center = center + offset;
 }
 
 bool MovingSphere::intercepts(Ray& r, float& t)
 {
-	Vector center = this->center_0 + (this->getCenter() - this->center_0) * ((r.time - this->time0) / (this->time1 - this->time0));
-	Vector oc = center - r.origin;
-	float b = r.direction * oc;
-
-	float c = oc * oc - this->getRadius()*this->getRadius();
-
-	if (pow(b, 2) - c <= 0) return false;
-
-	if (c > 0.0f) {
-		if (b <= 0.0f) return false;
-
-		t = b - sqrt(pow(b, 2) - c);
+	return MovingSpherePrim(center_0, getCenter(), getRadius(), time0, time1).intercepts(r, t);
+}
 
-	}
-	else t = b + sqrt(pow(b, 2) - c);
+bool MovingSphere::intercepts(Ray& r, HitRecord& rec)
+{
+	return MovingSpherePrim(center_0, getCenter(), getRadius(), time0, time1).intercepts(r, rec);
+}
 
-	return true;
+AABB MovingSphere::GetBoundingBox()
+{
+	return MovingSpherePrim(center_0, getCenter(), getRadius(), time0, time1).GetBoundingBox();
 }
 
+void MovingSphere::Compile(PrimitiveStore& store)
+{
+	store.add(MovingSpherePrim(center_0, getCenter(), getRadius(), time0, time1), this);
+}
 
-Vector Sphere::getNormal(Vector point)
+void MovingSphere::Translate(const Vector& offset)
 {
-	Vector normal = point - center;
-	return (normal.normalize());
+	Sphere::Translate(offset);
+	center_0 = center_0 + offset;
 }
 
 Vector Sphere::getCenter()
@@ -195,86 +351,167 @@ AABB aaBox::GetBoundingBox() {
 
 bool aaBox::intercepts(Ray& ray, float& t)
 {
-	//PUT HERE YOUR CODE
-	double tx_min, ty_min, tz_min;
-	double tx_max, ty_max, tz_max;
+	return BoxPrim(min, max).intercepts(ray, t);
+}
 
-	double a = 1.0 / ray.direction.x;
-	if (a >= 0) {
-		tx_min = (this->min.x - ray.origin.x) * a;
-		tx_max = (this->max.x - ray.origin.x) * a;
-	}
-	else {
-		tx_min = (this->max.x - ray.origin.x) * a;
-		tx_max = (this->min.x - ray.origin.x) * a;
-	}
+bool aaBox::intercepts(Ray& ray, HitRecord& rec)
+{
+	return BoxPrim(min, max).intercepts(ray, rec);
+}
 
-	double b = 1.0 / ray.direction.y;
-	if (b >= 0) {
-		ty_min = (this->min.y - ray.origin.y) * b;
-		ty_max = (this->max.y - ray.origin.y) * b;
-	}
-	else {
-		ty_min = (this->max.y - ray.origin.y) * b;
-		ty_max = (this->min.y - ray.origin.y) * b;
-	}
+void aaBox::Compile(PrimitiveStore& store)
+{
+	store.add(BoxPrim(min, max), this);
+}
 
-	double c = 1.0 / ray.direction.z;
-	if (c >= 0) {
-		tz_min = (this->min.z - ray.origin.z) * c;
-		tz_max = (this->max.z - ray.origin.z) * c;
-	}
-	else {
-		tz_min = (this->max.z - ray.origin.z) * c;
-		tz_max = (this->min.z - ray.origin.z) * c;
-	}
+void aaBox::Translate(const Vector& offset)
+{
+	min = min + offset;
+	max = max + offset;
+}
 
-	float tE, tL;
-	Vector face_in, face_out;
-	if (tx_min > ty_min) {
-		tE = tx_min;
-		face_in = (a >= 0.0) ? Vector(-1, 0, 0) : Vector(1, 0, 0);
-	}
-	else {
-		tE = ty_min;
-		face_in = (b >= 0.0) ? Vector(0, -1, 0) : Vector(0, 1, 0);
-	}
-	if (tz_min > tE) {
-		tE = tz_min;
-		face_in = (c >= 0.0) ? Vector(0, 0, -1) : Vector(0, 0, 1);
-	}
+Transform::Transform(void) : scale(1.0f), translation(0.0f, 0.0f, 0.0f)
+{
+	R[0] = Vector(1.0f, 0.0f, 0.0f);
+	R[1] = Vector(0.0f, 1.0f, 0.0f);
+	R[2] = Vector(0.0f, 0.0f, 1.0f);
+}
 
-	if (tx_max < ty_max) {
-		tL = tx_max;
-		face_out = (a >= 0.0) ? Vector(1, 0, 0) : Vector(-1, 0, 0);
-	}
-	else {
-		tL = ty_max;
-		face_out = (b >= 0.0) ? Vector(0, 1, 0) : Vector(0, -1, 0);
-	}
-	if (tz_max < tL) {
-		tL = tz_max;
-		face_out = (c >= 0.0) ? Vector(0, 0, 1) : Vector(0, 0, -1);
-	}
+Transform::Transform(const Vector& translation_, const Vector& angles, float scale_) : scale(scale_), translation(translation_)
+{
+	float cx = cos(angles.x * PI / 180), sx = sin(angles.x * PI / 180);
+	float cy = cos(angles.y * PI / 180), sy = sin(angles.y * PI / 180);
+	float cz = cos(angles.z * PI / 180), sz = sin(angles.z * PI / 180);
+
+	//R = Rz * Ry * Rx
+	R[0] = Vector(cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx);
+	R[1] = Vector(sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx);
+	R[2] = Vector(-sy, cy * sx, cy * cx);
+}
 
-	if (tE < tL && tL > 0) {
-		if (tE > 0) {
-			t = tE;
-			Normal = face_in;
-		}
-		else {
-			t = tL;
-			Normal = face_out;
-		}
-		return true;
-	}
+Vector Transform::dirToWorld(const Vector& d) const
+{
+	return Vector(R[0] * d, R[1] * d, R[2] * d);
+}
+
+Vector Transform::dirToLocal(const Vector& d) const
+{
+	return R[0] * d.x + R[1] * d.y + R[2] * d.z;  //the inverse of a rotation is its transpose
+}
+
+Vector Transform::pointToWorld(const Vector& p) const
+{
+	return dirToWorld(p) * scale + translation;
+}
+
+Vector Transform::pointToLocal(const Vector& p) const
+{
+	return dirToLocal(p - translation) * (1.0f / scale);
+}
+
+ObjectGroup::~ObjectGroup()
+{
+	delete blas;
+	for (Object* o : objects)
+		delete o;
+}
+
+void ObjectGroup::addObject(Object* o)
+{
+	index[o] = objects.size();
+	objects.push_back(o);
+}
+
+void ObjectGroup::Build(ThreadPool* pool)
+{
+	if (blas != NULL || objects.empty())
+		return;
+
+	bbox = objects[0]->GetBoundingBox();
+	for (Object* o : objects)
+		bbox.extend(o->GetBoundingBox());
+
+	printf("Group '%s': %d objects\n", name.c_str(), (int)objects.size());
+	blas = new BVH();
+	blas->Build(objects, pool);
+}
+
+// The bottom-level traversals run inside those of the scene accelerator, so they need their own stack
+static BVH::StackItem* blasStack(const BVH* blas)
+{
+	thread_local vector<BVH::StackItem> stack;
+
+	if (stack.size() < (size_t)blas->getStackSize())
+		stack.resize(blas->getStackSize());
+	return stack.data();
+}
+
+/* The direction is only rotated, so it stays unit length as the primitive tests expect, and the scale divides
+   the distances: t_local = t / scale. */
+Ray Instance::toLocal(const Ray& r)
+{
+	Ray local = Ray(transform.pointToLocal(r.origin), transform.dirToLocal(r.direction), r.time);
+	local.tmin = r.tmin / transform.scale;
+	local.tmax = (r.tmax == FLT_MAX) ? FLT_MAX : r.tmax / transform.scale;
+	return local;
+}
+
+bool Instance::traverse(Ray& r, Object** hit_obj, HitRecord& rec)
+{
+	const BVH* blas = group->getBVH();
+	if (blas == NULL)
+		return false;
+
+	Ray local = toLocal(r);
+	if (!blas->Traverse(local, hit_obj, rec, blasStack(blas)))
+		return false;
+	rec.t *= transform.scale;
+	return true;
+}
+
+bool Instance::occludes(Ray& r)
+{
+	const BVH* blas = group->getBVH();
+	if (blas == NULL)
+		return false;
+
+	Ray local = toLocal(r);
+	return blas->Occluded(local, blasStack(blas));
+}
+
+bool Instance::intercepts(Ray& r, float& t)
+{
+	Object* hit_obj;
+	HitRecord rec;
 
-	return false;
+	if (!traverse(r, &hit_obj, rec))
+		return false;
+	t = rec.t;
+	return true;
 }
 
-Vector aaBox::getNormal(Vector point)
+bool Instance::intercepts(Ray& r, HitRecord& rec)
 {
-	return Normal;
+	Object* hit_obj;
+
+	if (!traverse(r, &hit_obj, rec))
+		return false;
+	rec.normal = transform.dirToWorld(rec.normal);
+	rec.prim_id = group->getIndex(hit_obj);
+	return true;
+}
+
+AABB Instance::GetBoundingBox(void)
+{
+	AABB local = group->GetBoundingBox();
+	Vector corner = transform.pointToWorld(local.min);
+	AABB bbox = AABB(corner, corner);
+
+	for (int i = 1; i < 8; i++) {
+		corner = transform.pointToWorld(Vector((i & 1) ? local.max.x : local.min.x, (i & 2) ? local.max.y : local.min.y, (i & 4) ? local.max.z : local.min.z));
+		bbox.extend(AABB(corner, corner));
+	}
+	return bbox;
 }
 
 Scene::Scene()
@@ -288,6 +525,9 @@ Scene::~Scene()
 	}
 	objects.erase();
 	*/
+	//the scene owns its groups, however many instances place them
+	for (ObjectGroup* group : groups)
+		delete group;
 }
 
 int Scene::getNumObjects()
@@ -302,6 +542,28 @@ void Scene::addObject(Object* o)
 }
 
 
+void Scene::addAnimation(Object* o, const Vector& amplitude, float period)
+{
+	animations.push_back(Animation{ o, amplitude, period, Vector(0.0f, 0.0f, 0.0f) });
+}
+
+void Scene::Animate(unsigned int frame)
+{
+	for (Animation& anim : animations) {
+		Vector offset = anim.amplitude * fabs(sin(PI * frame / anim.period));
+		anim.obj->Translate(offset - anim.offset);
+		anim.offset = offset;
+	}
+}
+
+ObjectGroup* Scene::findGroup(const string& name)
+{
+	for (ObjectGroup* group : groups)
+		if (group->getName() == name)
+			return group;
+	return NULL;
+}
+
 Object* Scene::getObject(unsigned int index)
 {
 	if (index >= 0 && index < objects.size())
@@ -479,6 +741,10 @@ bool Scene::load_p3f(const char* name)
 	char		token[256];
 	ifstream	file(name, ios::in);
 	Material* material;
+	ObjectGroup* open_group = NULL;  //the objects added since group_start go to it at its "end"
+	size_t group_start = 0;
+	vector<TriangleMesh*> meshes;
+	float mesh_budget = 0.0f;  //MB for the meshes and their faces in the accelerators; 0 = unlimited
 
 	material = NULL;
 
@@ -565,21 +831,24 @@ bool Scene::load_p3f(const char* name)
 				}
 			}
 
-			else if (cmd == "mesh") {
+			else if (cmd == "mesh" || cmd == "qmesh") {  // qmesh: stored with 16-bit quantized vertices
 				unsigned total_vertices, total_faces;
 				unsigned P0, P1, P2;
-				Triangle* triangle;
-				Vector* verticesArray, vertex;
+				TriangleMesh* mesh;
+				vector<Vector> vertices;
+				vector<unsigned int> indices;
+				Vector vertex;
 
 				file >> total_vertices >> total_faces;
-				verticesArray = (Vector*)malloc(total_vertices * sizeof(Vector));
+				vertices.reserve(total_vertices);
+				indices.reserve(3 * total_faces);
 				for (int i = 0; i < total_vertices; i++) {
 					file >> vertex;
-					verticesArray[i] = vertex;
+					vertices.push_back(vertex);
 				}
 				for (int i = 0; i < total_faces; i++) {
 					file >> P0 >> P1 >> P2;
-					if (P0 > 0) {
+					if (P0 > 0) {  //vertex index start at 1
 						P0 -= 1;
 						P1 -= 1;
 						P2 -= 1;
@@ -589,11 +858,23 @@ bool Scene::load_p3f(const char* name)
 						P1 += total_vertices;
 						P2 += total_vertices;
 					}
-					triangle = new Triangle(verticesArray[P0], verticesArray[P1], verticesArray[P2]); //vertex index start at 1
-					if (material) triangle->SetMaterial(material);
-					this->addObject((Object*)triangle);
+					indices.push_back(P0);
+					indices.push_back(P1);
+					indices.push_back(P2);
 				}
+				mesh = new TriangleMesh(vertices, indices);
+				if (cmd == "qmesh")
+					mesh->Quantize();
+				if (material) mesh->SetMaterial(material);
+				this->addObject((Object*)mesh);
+				meshes.push_back(mesh);
+				printf("Mesh: %d vertices, %d faces, %.2f MB%s\n", total_vertices, total_faces, mesh->getMemorySize() / (1024.0 * 1024.0),
+					mesh->isQuantized() ? " (quantized)" : "");
+			}
 
+			else if (cmd == "mesh_budget")  // MB: the largest meshes are quantized until all of them fit
+			{
+				file >> mesh_budget;
 			}
 
 			else if (cmd == "pl")  // General Plane
@@ -609,6 +890,62 @@ bool Scene::load_p3f(const char* name)
 				//}
 			}
 
+			else if (cmd == "group")  // Named geometry, up to "end", placed by instances
+			{
+				string group_name;
+
+				file >> group_name;
+				if (open_group != NULL) {
+					cerr << "Groups cannot be nested.\n";
+					break;
+				}
+				if (findGroup(group_name) != NULL) {
+					cerr << "Group '" << group_name << "' already defined.\n";
+					break;
+				}
+				open_group = new ObjectGroup(group_name);
+				group_start = objects.size();
+			}
+
+			else if (cmd == "end")
+			{
+				if (open_group == NULL) {
+					cerr << "'end' without a group.\n";
+					break;
+				}
+				vector<Object*> unbounded;
+				for (size_t i = group_start; i < objects.size(); i++) {
+					if (objects[i]->IsUnbounded())
+						unbounded.push_back(objects[i]);  //has no bounds to be instanced
+					else
+						open_group->addObject(objects[i]);
+				}
+				if (!unbounded.empty())
+					cerr << "Planes cannot be instanced: they stay in the scene.\n";
+				objects.resize(group_start);
+				objects.insert(objects.end(), unbounded.begin(), unbounded.end());
+				groups.push_back(open_group);
+				open_group = NULL;
+			}
+
+			else if (cmd == "instance")  // instance <group> <translation> <rotation angles about x, y, z in degrees> <scale>
+			{
+				string group_name;
+				Vector translation, angles;
+				float scale;
+
+				file >> group_name >> translation >> angles >> scale;
+				ObjectGroup* group = findGroup(group_name);
+				if (group == NULL || open_group != NULL) {
+					if (group == NULL)
+						cerr << "Unknown group '" << group_name << "'.\n";
+					else
+						cerr << "Instances cannot be placed inside groups.\n";
+					break;
+				}
+				this->addObject((Object*)new Instance(group, Transform(translation, angles, scale)));
+			}
+
 			else if (cmd == "l")  // Need to check light color since by default is white
 			{
 				Vector pos;
@@ -695,9 +1032,39 @@ bool Scene::load_p3f(const char* name)
 	}
 
 	file.close();
+
+	if (open_group != NULL) {
+		cerr << "Group '" << open_group->getName() << "' without 'end': its objects stay in the scene.\n";
+		delete open_group;
+	}
+
+	if (mesh_budget > 0.0f)
+		fit_mesh_budget(meshes, (size_t)(mesh_budget * 1024.0 * 1024.0));
 	return true;
 };
 
+// Quantizes the largest meshes until the meshes and the faces the accelerators keep of them fit in budget bytes
+void Scene::fit_mesh_budget(vector<TriangleMesh*>& meshes, size_t budget)
+{
+	size_t total = 0;
+	for (TriangleMesh* mesh : meshes)
+		total += mesh->getRenderMemorySize();
+
+	sort(meshes.begin(), meshes.end(), [](TriangleMesh* a, TriangleMesh* b) { return a->getRenderMemorySize() > b->getRenderMemorySize(); });
+	for (TriangleMesh* mesh : meshes) {
+		if (total <= budget)
+			break;
+		if (mesh->isQuantized())
+			continue;
+		total -= mesh->getRenderMemorySize();
+		mesh->Quantize();
+		total += mesh->getRenderMemorySize();
+	}
+
+	printf("Meshes: %.2f MB with their faces, budget %.2f MB%s\n", total / (1024.0 * 1024.0), budget / (1024.0 * 1024.0),
+		total > budget ? " (exceeded with all of them quantized)" : "");
+}
+
 void Scene::create_random_scene() {
 	Camera* camera;
 	Material* material;
@@ -727,6 +1094,7 @@ void Scene::create_random_scene() {
 	if (material) sphere->SetMaterial(material);
 	this->addObject((Object*)sphere);
 
+	size_t first_small = objects.size();
 	for (int a = -5; a < 5; a++)
 		for (int b = -5; b < 5; b++) {
 
@@ -758,6 +1126,10 @@ void Scene::create_random_scene() {
 
 		}
 
+	//the small spheres bounce when the animation is on; the heights and periods do not draw random numbers, so the scene stays the same
+	for (size_t i = first_small; i < objects.size(); i++)
+		addAnimation(objects[i], Vector(0.0f, 0.3f + 0.1f * (i % 5), 0.0f), 20.0f + 4.0f * (i % 7));
+
 	material = new Material(Color(0.0, 0.0, 0.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5);
 	sphere = new Sphere(Vector(0.0, 1.0, 0.0), 1.0);
 	if (material) sphere->SetMaterial(material);
@@ -2,7 +2,10 @@
 #define SCENE_H
 
 #include <vector>
+#include <string>
+#include <unordered_map>
 #include <cmath>
+#include <stdint.h>
 #include <IL/il.h>
 using namespace std;
 
@@ -13,7 +16,7 @@ using namespace std;
 #include "boundingBox.h"
 
 //Type of acceleration structure
-typedef enum { NONE, GRID_ACC, BVH_ACC }  accelerator;
+typedef enum { NONE, GRID_ACC, BVH_ACC, WBVH_ACC, MBVH_ACC, HGRID_ACC }  accelerator;
 
 //Skybox images constant symbolics
 typedef enum { RIGHT, LEFT, TOP, BOTTOM, FRONT, BACK } CubeMap;
@@ -64,16 +67,48 @@ public:
 	float width, height;
 };
 
+// Result of a ray/primitive intersection
+struct HitRecord
+{
+	float t;               // ray parameter of the hit point
+	unsigned int prim_id;  // primitive hit inside the object (0 for single primitives)
+	Vector normal;         // geometric normal at the hit point
+	float u, v;            // barycentric coordinates (triangles only)
+};
+
+class PrimitiveStore;
+struct TrianglePrim;
+class BVH;
+class ThreadPool;
+
 class Object
 {
 public:
+	virtual ~Object() {}  // the groups delete their objects
 
 	Material* GetMaterial() { return m_Material; }
+	// Material at a hit on this object; an instance reports that of the group object it hit
+	virtual Material* GetMaterial(const HitRecord&) { return m_Material; }
 	void SetMaterial( Material *a_Mat ) { m_Material = a_Mat; }
-	virtual bool intercepts( Ray& r, float& dist ) = 0;
-	virtual Vector getNormal( Vector point ) = 0;
+	virtual bool intercepts( Ray& r, float& dist ) = 0;       // distance only (shadow rays)
+	virtual bool intercepts( Ray& r, HitRecord& rec ) = 0;    // distance, normal and barycentrics
+	// Any hit in [r.tmin, r.tmax] (shadow rays), for objects with a cheaper test than their closest hit to override
+	virtual bool occludes(Ray& r) { float dist; return intercepts(r, dist) && dist > r.tmin && dist < r.tmax; }
 	virtual AABB GetBoundingBox() { return AABB(); }
 	Vector getCentroid(void) { return GetBoundingBox().centroid(); }
+	// Objects without a finite bounding box (planes) are kept out of the accelerators and tested on their own
+	virtual bool IsUnbounded() { return false; }
+
+	// Objects made of several primitives (meshes) are handed to the accelerators one primitive at a time
+	virtual unsigned int GetNumPrimitives() { return 1; }
+	virtual AABB GetBoundingBox(unsigned int) { return GetBoundingBox(); }
+	virtual bool intercepts(Ray& r, unsigned int, float& dist) { return intercepts(r, dist); }
+	virtual bool intercepts(Ray& r, unsigned int, HitRecord& rec) { return intercepts(r, rec); }
+	virtual bool occludes(Ray& r, unsigned int prim) { float dist; return intercepts(r, prim, dist) && dist > r.tmin && dist < r.tmax; }
+	// Adds the primitives to the render representation of the accelerators (by default, tested through this object)
+	virtual void Compile(PrimitiveStore& store);
+	// Animation: moves the object. The accelerators see the new position once refitted (BVH::Refit) or built again.
+	virtual void Translate(const Vector&) {}
 
 protected:
 	Material* m_Material;
@@ -91,7 +126,9 @@ public:
 		 Plane		(Vector& P0, Vector& P1, Vector& P2);
 
 		 bool intercepts( Ray& r, float& dist );
-         Vector getNormal(Vector point);
+		 bool intercepts( Ray& r, HitRecord& rec );
+		 bool IsUnbounded() { return true; }
+		 void Translate(const Vector& offset);
 };
 
 class Triangle : public Object
@@ -100,16 +137,68 @@ class Triangle : public Object
 public:
 	Triangle	(Vector& P0, Vector& P1, Vector& P2);
 	bool intercepts( Ray& r, float& t);
-	Vector getNormal(Vector point);
+	bool intercepts( Ray& r, HitRecord& rec);
 	AABB GetBoundingBox(void);
+	void Compile(PrimitiveStore& store);
+	void Translate(const Vector& offset);
 	
 protected:
+	bool intersect(Ray& r, float& t, float& beta, float& gamma);
+
 	Vector points[3];
 	Vector normal;
 	Vector Min, Max;
 };
 
 
+// Vertex positions quantized to 16 bits per coordinate over the bounds of a mesh: p = origin + q * step
+struct QuantizedMesh
+{
+	Vector origin, step;
+	vector<uint16_t> positions;    // 3 per vertex
+	vector<unsigned int> indices;  // 3 per face
+
+	Vector getVertex(unsigned int i) const {
+		return Vector(origin.x + positions[3 * i] * step.x, origin.y + positions[3 * i + 1] * step.y, origin.z + positions[3 * i + 2] * step.z);
+	}
+};
+
+// Indexed triangle mesh: one vertex buffer and one index buffer (three 32-bit indices per face) shared by
+// all the faces, plus the face normals. The accelerators reference its faces as primitives (mesh, face).
+// Quantize() replaces the vertices and normals by 16-bit positions, decoded when the faces are tested.
+class TriangleMesh : public Object
+{
+public:
+	TriangleMesh(vector<Vector>& vertices_, vector<unsigned int>& indices_);
+	~TriangleMesh();
+
+	unsigned int GetNumPrimitives() { return n_faces; }
+	AABB GetBoundingBox(void);
+	AABB GetBoundingBox(unsigned int face);
+	bool intercepts(Ray& r, float& t);          // closest face, testing all of them
+	bool intercepts(Ray& r, HitRecord& rec);
+	bool intercepts(Ray& r, unsigned int face, float& t);
+	bool intercepts(Ray& r, unsigned int face, HitRecord& rec);
+	void Compile(PrimitiveStore& store);
+	void Translate(const Vector& offset);
+	size_t getMemorySize();
+	size_t getRenderMemorySize();  // with the copies of its faces in the accelerators
+	void Quantize();
+	bool isQuantized() { return quantized != NULL; }
+
+private:
+	TrianglePrim getTriangle(unsigned int face);  // decoded when quantized
+	bool intersect(unsigned int face, Ray& r, float& t, float& u, float& v);
+
+	vector<Vector> vertices;
+	vector<unsigned int> indices;
+	vector<Vector> normals;   // per face
+	unsigned int n_faces;
+	AABB bbox;
+	QuantizedMesh* quantized = NULL;  // replaces vertices, indices and normals
+};
+
+
 class Sphere : public Object
 {
 public:
@@ -118,10 +207,12 @@ public:
 		radius( a_radius ) {};
 
 	bool intercepts( Ray& r, float& t);
-	Vector getNormal(Vector point);
+	bool intercepts( Ray& r, HitRecord& rec);
 	Vector getCenter();
 	float getRadius();
 	AABB GetBoundingBox(void);
+	void Compile(PrimitiveStore& store);
+	void Translate(const Vector& offset);
 
 private:
 	Vector center;
@@ -135,6 +226,10 @@ public:
 		Sphere(center_1, a_radius), center_0(center_0), time0(time0), time1(time1) {};
 
 	bool intercepts(Ray& r, float& t);
+	bool intercepts(Ray& r, HitRecord& rec);
+	AABB GetBoundingBox(void);
+	void Compile(PrimitiveStore& store);
+	void Translate(const Vector& offset);
 private:
 	Vector center_0;
 	float time0, time1;
@@ -146,13 +241,78 @@ public:
 	aaBox(Vector& minPoint, Vector& maxPoint);
 	AABB GetBoundingBox(void);
 	bool intercepts(Ray& r, float& t);
-	Vector getNormal(Vector point);
+	bool intercepts(Ray& r, HitRecord& rec);
+	void Compile(PrimitiveStore& store);
+	void Translate(const Vector& offset);
 
 private:
 	Vector min;
 	Vector max;
+};
 
-	Vector Normal;
+// Placement of an instance: p_world = scale * R * p_local + translation, with R a rotation
+struct Transform
+{
+	Vector R[3];  // rows of the rotation
+	float scale;
+	Vector translation;
+
+	Transform(void);  // identity
+	Transform(const Vector& translation_, const Vector& angles, float scale_);  // angles in degrees about x, then y, then z
+	Vector pointToWorld(const Vector& p) const;
+	Vector pointToLocal(const Vector& p) const;
+	Vector dirToWorld(const Vector& d) const;  // rotation only, so unit vectors stay unit
+	Vector dirToLocal(const Vector& d) const;
+};
+
+// Named geometry that instances place many times (p3f "group <name> ... end"). Its objects are not in the scene:
+// they get one bottom-level BVH, which every instance of the group traverses in object space.
+class ObjectGroup
+{
+public:
+	ObjectGroup(const string& name_) : name(name_) {}
+	~ObjectGroup();  // deletes its objects
+	ObjectGroup(const ObjectGroup&) = delete;  // the instances point to it
+	ObjectGroup& operator=(const ObjectGroup&) = delete;
+
+	void addObject(Object* o);
+	void Build(ThreadPool* pool = NULL);  // the bottom-level BVH, before the instances are rendered
+	const string& getName() { return name; }
+	int getNumObjects() { return objects.size(); }
+	Object* getObject(unsigned int index) { return objects[index]; }
+	unsigned int getIndex(Object* o) { return index[o]; }
+	const AABB& GetBoundingBox() { return bbox; }
+	const BVH* getBVH() { return blas; }
+
+private:
+	string name;
+	vector<Object*> objects;
+	unordered_map<Object*, unsigned int> index;  // of every object in objects
+	AABB bbox;
+	BVH* blas = NULL;
+};
+
+// Transformed copy of a group (p3f "instance"). The scene accelerator, which bounds the instances, is the top
+// level: the rays that reach an instance are moved to the object space of its group and traverse its BVH.
+class Instance : public Object
+{
+public:
+	Instance(ObjectGroup* group_, const Transform& transform_) : group(group_), transform(transform_) { m_Material = NULL; }
+
+	bool intercepts(Ray& r, float& t);
+	bool intercepts(Ray& r, HitRecord& rec);  // rec.prim_id is the index of the hit object in the group
+	bool occludes(Ray& r);                    // any hit of the group's BVH, without the search for the closest
+	bool occludes(Ray& r, unsigned int) { return occludes(r); }
+	AABB GetBoundingBox(void);
+	Material* GetMaterial(const HitRecord& rec) { return group->getObject(rec.prim_id)->GetMaterial(); }
+	void Translate(const Vector& offset) { transform.translation = transform.translation + offset; }
+
+private:
+	Ray toLocal(const Ray& r);  // the ray in the object space of the group
+	bool traverse(Ray& r, Object** hit_obj, HitRecord& rec);
+
+	ObjectGroup* group;
+	Transform transform;
 };
 
 
@@ -184,12 +344,32 @@ public:
 	void addLight( Light* l );
 	Light* getLight( unsigned int index );
 
+	int getNumGroups() { return groups.size(); }
+	ObjectGroup* getGroup(unsigned int index) { return groups[index]; }
+	ObjectGroup* findGroup(const string& name);  // NULL if there is no group with that name
+
 	bool load_p3f(const char *name);  //Load NFF file method
 	void create_random_scene();
+
+	// Animation: the object bounces between its position and position + amplitude, once every period frames
+	void addAnimation(Object* o, const Vector& amplitude, float period);
+	bool hasAnimations() { return !animations.empty(); }
+	void Animate(unsigned int frame);  // moves the animated objects to their position at the given frame
 	
 private:
 	vector<Object *> objects;
 	vector<Light *> lights;
+	vector<ObjectGroup *> groups;  // their objects are only reached through instances
+
+	void fit_mesh_budget(vector<TriangleMesh*>& meshes, size_t budget);
+
+	struct Animation {
+		Object* obj;
+		Vector amplitude;
+		float period;   // in frames
+		Vector offset;  // current displacement from the initial position
+	};
+	vector<Animation> animations;
 
 	Camera* camera;
 	Color bgColor;  //Background color
@@ -0,0 +1,142 @@
+#include <algorithm>
+#include "threadPool.h"
+
+// Index of the deque owned by the current thread. Threads that are not pool workers share deque 0.
+static thread_local unsigned int worker_id = 0;
+
+ThreadPool::ThreadPool(unsigned int n_threads) : queued(0), shutdown(false)
+{
+	if (n_threads == 0)
+		n_threads = thread::hardware_concurrency();
+	if (n_threads == 0)
+		n_threads = 1;
+
+	for (unsigned int i = 0; i < n_threads; i++)
+		queues.push_back(new WorkQueue());
+
+	//the calling thread acts as worker 0, so only n_threads - 1 threads are created
+	for (unsigned int i = 1; i < n_threads; i++)
+		workers.push_back(thread(&ThreadPool::WorkerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool(void)
+{
+	{
+		unique_lock<mutex> lock(sleep_lock);
+		shutdown = true;
+	}
+	wake.notify_all();
+	for (auto& w : workers)
+		w.join();
+	for (auto q : queues)
+		delete q;
+}
+
+void ThreadPool::Spawn(TaskGroup& group, function<void()> task)
+{
+	Spawn(group, task, worker_id);
+}
+
+void ThreadPool::Spawn(TaskGroup& group, function<void()> task, unsigned int worker)
+{
+	WorkQueue* q = queues[worker % queues.size()];
+
+	group.pending++;
+	{
+		lock_guard<mutex> lock(q->lock);
+		q->tasks.push_back({ task, &group });
+	}
+	{
+		lock_guard<mutex> lock(sleep_lock);
+		queued++;
+	}
+	wake.notify_one();
+}
+
+void ThreadPool::Wait(TaskGroup& group)
+{
+	while (!group.isDone()) {
+		if (RunOne(worker_id))
+			continue;
+
+		//nothing to run or steal: sleep until a task is queued or the last task of a group finishes
+		unique_lock<mutex> lock(sleep_lock);
+		wake.wait(lock, [&]() { return group.isDone() || queued.load() > 0; });
+	}
+}
+
+void ThreadPool::ParallelFor(int begin, int end, int grain, function<void(int, int)> body)
+{
+	TaskGroup group;
+	int n_chunks = (end - begin + grain - 1) / grain;
+	unsigned int n_queues = queues.size();
+
+	//contiguous chunks are seeded on the same deque; idle workers steal the rest
+	for (int c = 0; c < n_chunks; c++) {
+		int first = begin + c * grain;
+		int last = min(first + grain, end);
+		Spawn(group, [=]() { body(first, last); }, (unsigned int)((long long)c * n_queues / n_chunks));
+	}
+	Wait(group);
+}
+
+void ThreadPool::WorkerLoop(unsigned int id)
+{
+	worker_id = id;
+
+	while (true) {
+		if (RunOne(id))
+			continue;
+
+		unique_lock<mutex> lock(sleep_lock);
+		wake.wait(lock, [this]() { return shutdown || queued.load() > 0; });
+		if (shutdown)
+			return;
+	}
+}
+
+bool ThreadPool::RunOne(unsigned int id)
+{
+	Task task;
+
+	if (!Pop(id, task) && !Steal(id, task))
+		return false;
+
+	queued--;
+	task.fn();
+	if (--task.group->pending == 0) {
+		//the group may be destroyed by its waiter from here on
+		{ lock_guard<mutex> lock(sleep_lock); }
+		wake.notify_all();
+	}
+	return true;
+}
+
+bool ThreadPool::Pop(unsigned int id, Task& task)
+{
+	WorkQueue* q = queues[id];
+	lock_guard<mutex> lock(q->lock);
+
+	if (q->tasks.empty())
+		return false;
+	task = q->tasks.back();
+	q->tasks.pop_back();
+	return true;
+}
+
+bool ThreadPool::Steal(unsigned int id, Task& task)
+{
+	unsigned int n = queues.size();
+
+	for (unsigned int i = 1; i < n; i++) {
+		WorkQueue* q = queues[(id + i) % n];
+		lock_guard<mutex> lock(q->lock);
+
+		if (!q->tasks.empty()) {
+			task = q->tasks.front();
+			q->tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
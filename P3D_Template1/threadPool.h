@@ -0,0 +1,73 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+using namespace std;
+
+// Set of tasks that can be waited for as a whole
+class TaskGroup
+{
+public:
+	TaskGroup(void) : pending(0) {}
+	bool isDone() { return pending.load() == 0; }
+
+private:
+	friend class ThreadPool;
+	atomic<int> pending;
+};
+
+// Pool of worker threads with one deque per worker and work stealing:
+// a worker pops its own tasks from the back (LIFO) and, when it runs dry,
+// steals the oldest task from the front of another worker's deque.
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned int n_threads = 0);  // 0 = all hardware threads
+	~ThreadPool(void);
+
+	unsigned int getNumThreads() { return (unsigned int)queues.size(); }
+
+	// Push a task on the calling worker's deque (or on a given worker's deque)
+	void Spawn(TaskGroup& group, function<void()> task);
+	void Spawn(TaskGroup& group, function<void()> task, unsigned int worker);
+
+	// The calling thread runs and steals tasks until every task of the group has finished, and sleeps while
+	// there is none left to run
+	void Wait(TaskGroup& group);
+
+	// Splits [begin, end) in chunks of grain iterations and runs body(first, last) on each chunk
+	void ParallelFor(int begin, int end, int grain, function<void(int, int)> body);
+
+private:
+	struct Task {
+		function<void()> fn;
+		TaskGroup* group;
+	};
+
+	struct WorkQueue {
+		mutex lock;
+		deque<Task> tasks;
+	};
+
+	vector<thread> workers;
+	vector<WorkQueue*> queues;  // queues[0] is owned by the thread that created the pool
+
+	mutex sleep_lock;
+	condition_variable wake;
+	atomic<int> queued;
+	bool shutdown;
+
+	void WorkerLoop(unsigned int id);
+	bool RunOne(unsigned int id);
+	bool Pop(unsigned int id, Task& task);
+	bool Steal(unsigned int id, Task& task);
+};
+
+#endif
@@ -7,12 +7,12 @@ Vector::Vector(float a_x, float a_y, float a_z) : x(a_x), y(a_y), z(a_z)
 }
 
 
-float Vector::length()
+float Vector::length() const
 {
 	return sqrt( x * x + y * y + z * z );
 }
 
-float Vector::getAxisValue(int axis) {
+float Vector::getAxisValue(int axis) const {
 	return (axis == 0) ? x : (axis == 1) ? y : z;
 }
 
@@ -37,29 +37,29 @@ Vector Vector::operator= (const Vector& rhs) {
 	return (*this);
 }
 
-Vector Vector::operator+(const  Vector& v )
+Vector Vector::operator+(const  Vector& v ) const
 {
 	return Vector( x + v.x, y + v.y, z + v.z );
 }
 
 
-Vector Vector::operator-(const Vector& v )
+Vector Vector::operator-(const Vector& v ) const
 {
 	return Vector( x - v.x, y - v.y, z - v.z );
 }
 
 
-Vector Vector::operator*( float f )
+Vector Vector::operator*( float f ) const
 {
 	return Vector( x * f, y * f, z * f );
 }
 
-float Vector::operator*(const  Vector& v)
+float Vector::operator*(const  Vector& v) const
 {
 	return x * v.x + y * v.y + z * v.z;
 }
 
-Vector Vector::operator/( float f )
+Vector Vector::operator/( float f ) const
 {
 	return Vector( x / f, y / f, z / f );
 }
@@ -83,7 +83,7 @@ Vector&	Vector::operator+=(const float v)
 Vector&	Vector::operator*=(const float v)
 { x*=v; y*=v; z*=v; return *this; }
 
-Vector Vector::operator%( const Vector& v)
+Vector Vector::operator%( const Vector& v) const
 {
 	float uX = x;
 	float uY = y;
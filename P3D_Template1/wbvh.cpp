@@ -0,0 +1,213 @@
+#include <malloc.h>
+#include <string.h>
+#include "rayAccelerator.h"
+#include "macros.h"
+
+using namespace std;
+
+WideBVH::WideNode::WideNode(void) {
+	for (int i = 0; i < WBVH_WIDTH; i++) {
+		for (int d = 0; d < 3; d++) {
+			bmin[d][i] = FLT_MAX;
+			bmax[d][i] = -FLT_MAX;
+		}
+		index[i] = 0;
+		n_objs[i] = 0;
+	}
+}
+
+void WideBVH::WideNode::setChild(int slot, AABB& bbox_, unsigned int index_, unsigned int n_objs_) {
+	bmin[0][slot] = bbox_.min.x; bmin[1][slot] = bbox_.min.y; bmin[2][slot] = bbox_.min.z;
+	bmax[0][slot] = bbox_.max.x; bmax[1][slot] = bbox_.max.y; bmax[2][slot] = bbox_.max.z;
+	index[slot] = index_;
+	n_objs[slot] = n_objs_;
+}
+
+// Same slab test as BVHNode::intercepts, on all the children at once. The near and far planes are picked
+// by the sign of the direction instead of a min/max of both, so the inverted boxes of empty slots always miss.
+int WideBVH::WideNode::intercepts(const Vector& origin, const Vector& inv_dir, float tmax, float* t) const {
+	int nx = inv_dir.x < 0, ny = inv_dir.y < 0, nz = inv_dir.z < 0;
+	vfloat ox(origin.x), oy(origin.y), oz(origin.z);
+	vfloat ix(inv_dir.x), iy(inv_dir.y), iz(inv_dir.z);
+
+	vfloat tx_min = (vfloat::load(nx ? bmax[0] : bmin[0]) - ox) * ix, tx_max = (vfloat::load(nx ? bmin[0] : bmax[0]) - ox) * ix;
+	vfloat ty_min = (vfloat::load(ny ? bmax[1] : bmin[1]) - oy) * iy, ty_max = (vfloat::load(ny ? bmin[1] : bmax[1]) - oy) * iy;
+	vfloat tz_min = (vfloat::load(nz ? bmax[2] : bmin[2]) - oz) * iz, tz_max = (vfloat::load(nz ? bmin[2] : bmax[2]) - oz) * iz;
+
+	//largest entering t value, clamped to 0 when the ray starts inside the box
+	vfloat t0 = vmax(vmax(tx_min, ty_min), vmax(tz_min, vfloat(0.0f)));
+
+	//smallest exiting t value, clamped to the closest hit found so far
+	vfloat t1 = vmin(vmin(tx_max, ty_max), vmin(tz_max, vfloat(tmax)));
+
+	t0.store(t);
+	return movemask(t0 < t1);
+}
+
+
+WideBVH::WideBVH(void) {}
+
+WideBVH::~WideBVH(void) {
+	if (nodes != NULL)
+		_aligned_free(nodes);
+}
+
+int WideBVH::getNumObjects() { return bvh.getNumObjects(); }
+
+void WideBVH::Build(vector<Object*>& objs, ThreadPool* pool) {
+	//free the nodes of a previous build
+	if (nodes != NULL)
+		_aligned_free(nodes);
+	nodes = NULL; n_nodes = 0;
+	max_depth = 0;
+
+	bvh.Build(objs, pool);
+	if (bvh.nodes == NULL)
+		return;
+
+	vector<WideNode> build_nodes;
+	build_nodes.reserve(bvh.n_nodes / (WBVH_WIDTH - 1) + 1);
+	max_depth = this->collapse(0, build_nodes, 0);
+
+	//copy the depth-first node list to one cache-line aligned block
+	n_nodes = build_nodes.size();
+	nodes = (WideNode*)_aligned_malloc(n_nodes * sizeof(WideNode), 64);
+	memcpy(nodes, build_nodes.data(), n_nodes * sizeof(WideNode));
+
+	//only the objects vector and the leaf blocks of the binary tree are still needed
+	_aligned_free(bvh.nodes);
+	bvh.nodes = NULL;
+
+	printf("Wide BVH: %d-wide, total nodes = %d, depth = %d\n\n", WBVH_WIDTH, n_nodes, max_depth);
+}
+
+/* Appends the wide node that replaces the binary node bin_index, followed by its subtrees, and returns
+   the deepest level below it. The children are gathered by repeatedly opening the interior child with
+   the largest surface area, which is the one most likely to be hit, until the node is full. */
+int WideBVH::collapse(unsigned int bin_index, vector<WideNode>& node_list, int depth) {
+	const BVH::BVHNode* bin_nodes = bvh.nodes;
+	unsigned int children[WBVH_WIDTH];
+	int n_children = 0;
+
+	if (bin_nodes[bin_index].isLeaf())
+		children[n_children++] = bin_index;  //the whole tree is one leaf
+	else {
+		children[n_children++] = bin_index + 1;
+		children[n_children++] = bin_nodes[bin_index].getIndex();
+	}
+
+	while (n_children < WBVH_WIDTH) {
+		int best = -1;
+		float best_area = -1.0f;
+		for (int i = 0; i < n_children; i++) {
+			if (bin_nodes[children[i]].isLeaf())
+				continue;
+			float area = bin_nodes[children[i]].getAABB().surface_area();
+			if (area > best_area) {
+				best_area = area;
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;  //only leaves left
+
+		unsigned int opened = children[best];
+		children[best] = opened + 1;
+		children[n_children++] = bin_nodes[opened].getIndex();
+	}
+
+	unsigned int node_index = node_list.size();
+	int deepest = depth;
+	node_list.push_back(WideNode());
+
+	for (int i = 0; i < n_children; i++) {
+		const BVH::BVHNode& child = bin_nodes[children[i]];
+		AABB bbox = child.getAABB();
+
+		if (child.isLeaf())
+			node_list[node_index].setChild(i, bbox, child.getIndex(), child.getNObjs());
+		else {
+			node_list[node_index].setChild(i, bbox, node_list.size(), 0);
+			int child_depth = this->collapse(children[i], node_list, depth + 1);
+			deepest = MAX(deepest, child_depth);
+		}
+	}
+	return deepest;
+}
+
+bool WideBVH::Traverse(Ray& ray, Object** hit_obj, HitRecord& hit_rec, StackItem* stack) const {
+	float tmin = ray.tmax;  //contains the closest primitive intersection
+	int stack_ptr = 0;
+	alignas(32) float t[WBVH_WIDTH];
+
+	if (nodes == NULL)
+		return false;
+
+	Vector inv_dir = Vector(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	stack[stack_ptr++] = StackItem(0, 0, 0.0f);  //root node
+
+	while (stack_ptr > 0) {
+		StackItem item = stack[--stack_ptr];
+		if (item.t >= tmin)
+			continue;  //a closer hit was found after this entry was pushed
+
+		if (item.n_objs != 0) {
+			bvh.intersect_leaf(item.index, item.n_objs, ray, tmin, hit_obj, hit_rec);
+			continue;
+		}
+
+		const WideNode& node = nodes[item.index];
+		int mask = node.intercepts(ray.origin, inv_dir, tmin, t);
+
+		//push the children sorted far to near, so that the nearest one is popped first
+		int first = stack_ptr;
+		for (int i = 0; i < WBVH_WIDTH; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+			StackItem si(node.getIndex(i), node.getNObjs(i), t[i]);
+			int j = stack_ptr++;
+			while (j > first && stack[j - 1].t < si.t) {
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = si;
+		}
+	}
+
+	return (tmin < ray.tmax);
+}
+
+// Children entered beyond ray.tmax are never pushed.
+bool WideBVH::Occluded(Ray& ray, StackItem* stack) const {
+	int stack_ptr = 0;
+	alignas(32) float t[WBVH_WIDTH];
+
+	if (nodes == NULL)
+		return false;
+
+	Vector inv_dir = Vector(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	stack[stack_ptr++] = StackItem(0, 0, 0.0f);  //root node
+
+	//any hit ends the traversal, so the children are visited in any order
+	while (stack_ptr > 0) {
+		StackItem item = stack[--stack_ptr];
+
+		if (item.n_objs != 0) {
+			if (bvh.occluded_leaf(item.index, item.n_objs, ray))
+				return true;
+			continue;
+		}
+
+		const WideNode& node = nodes[item.index];
+		int mask = node.intercepts(ray.origin, inv_dir, ray.tmax, t);
+
+		for (int i = 0; i < WBVH_WIDTH; i++) {
+			if (mask & (1 << i))
+				stack[stack_ptr++] = StackItem(node.getIndex(i), node.getNObjs(i), t[i]);
+		}
+	}
+
+	return(false);
+}